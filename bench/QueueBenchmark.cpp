@@ -0,0 +1,86 @@
+// contention benchmark of the request queues
+// half of the threads produce and half consume the same number of items through one queue
+// usage: QueueBenchmark [items per producer] [queue size]
+
+#include "ArrayBlockingQueue.hpp"
+#include "MPMCQueue.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+struct Item {
+    long value;
+};
+
+template <typename Queue> double run(int threads, long items, unsigned int queueSize) {
+    Queue queue(queueSize);
+    const int producers = threads > 1 ? threads / 2 : 1;
+    const int consumers = threads > 1 ? threads - producers : 1;
+    const long total = items * producers;
+    Item *pool = new Item[total];
+    std::atomic<long> consumed(0);
+    std::atomic<long> sum(0);
+    std::atomic<bool> start(false);
+    std::vector<std::thread> workers;
+
+    for (int p = 0; p < producers; p++) {
+        workers.emplace_back([&, p] {
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            for (long i = 0; i < items; i++) {
+                Item *item = &pool[p * items + i];
+                item->value = i;
+                queue.enqueue(item);
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        workers.emplace_back([&] {
+            while (!start.load(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+            long local = 0;
+            while (consumed.load(std::memory_order_relaxed) < total) {
+                Item *item = queue.dequeue_for(std::chrono::milliseconds(10));
+                if (item != nullptr) {
+                    local += item->value;
+                    consumed.fetch_add(1, std::memory_order_relaxed);
+                }
+            }
+            sum.fetch_add(local);
+        });
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    start.store(true, std::memory_order_release);
+    for (std::thread &worker : workers) {
+        worker.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    if (sum.load() != producers * (items * (items - 1) / 2)) {
+        fprintf(stderr, "lost or duplicated items\n");
+        exit(1);
+    }
+    delete[] pool;
+    return total / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    const long items = argc > 1 ? atol(argv[1]) : 200000;
+    const unsigned int queueSize = argc > 2 ? atoi(argv[2]) : 1024;
+    const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+
+    printf("%8s %20s %20s %8s\n", "threads", "ArrayBlockingQueue", "MPMCQueue", "ratio");
+    for (int threads : threadCounts) {
+        double blocking = run<util::ArrayBlockingQueue<Item>>(threads, items, queueSize);
+        double lockFree = run<util::MPMCQueue<Item>>(threads, items, queueSize);
+        printf("%8d %15.0f op/s %15.0f op/s %7.2fx\n", threads, blocking, lockFree, lockFree / blocking);
+    }
+    return 0;
+}
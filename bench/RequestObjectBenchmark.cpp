@@ -0,0 +1,151 @@
+// per request overhead of the V8 bridge
+// builds the request object passed to the handler and reads its socket back the way the core functions do:
+// the old way with fresh key strings and a global socket property, the new way with a prebuilt template,
+// internalized keys and the socket in an internal field
+// usage: RequestObjectBenchmark [requests]
+
+#define V8_COMPRESS_POINTERS
+#define V8_31BIT_SMIS_ON_64BIT_ARCH
+#include <libplatform/libplatform.h>
+#include <v8.h>
+
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SOCKET_VAR_NAME "_this_is_the_socket_variable_in_the_execution_context"
+
+enum RequestKey { KEY_SOCKET, KEY_METHOD, KEY_URI, KEY_PATH, KEY_BODY_STREAMED, KEY_COUNT };
+static const char *names[KEY_COUNT] = {"socket", "method", "uri", "path", "bodyStreamed"};
+
+// what every core call did to find its socket
+static int globalSocket(v8::Isolate *isolate, v8::Local<v8::Context> context) {
+    auto value = context->Global()->Get(context, v8::String::NewFromUtf8(isolate, SOCKET_VAR_NAME, v8::NewStringType::kNormal).ToLocalChecked());
+    v8::Local<v8::Value> socket;
+    if (value.ToLocal(&socket) && socket->IsNumber()) {
+        return socket->Int32Value(context).ToChecked();
+    }
+    return -1;
+}
+
+static v8::Local<v8::Object> oldObject(v8::Isolate *isolate, v8::Local<v8::Context> context, int socket) {
+    v8::Local<v8::Object> request = v8::Object::New(isolate);
+    auto t = context->Global()->Set(context, v8::String::NewFromUtf8(isolate, SOCKET_VAR_NAME, v8::NewStringType::kNormal).ToLocalChecked(), v8::Int32::New(isolate, socket));
+    t = request->Set(context, v8::String::NewFromUtf8(isolate, "socket", v8::NewStringType::kNormal).ToLocalChecked(), v8::Int32::New(isolate, socket));
+    t = request->Set(context, v8::String::NewFromUtf8(isolate, "method", v8::NewStringType::kNormal).ToLocalChecked(), v8::String::NewFromUtf8(isolate, "GET", v8::NewStringType::kNormal).ToLocalChecked());
+    t = request->Set(context, v8::String::NewFromUtf8(isolate, "uri", v8::NewStringType::kNormal).ToLocalChecked(), v8::String::NewFromUtf8(isolate, "/index.html?a=1", v8::NewStringType::kNormal).ToLocalChecked());
+    t = request->Set(context, v8::String::NewFromUtf8(isolate, "path", v8::NewStringType::kNormal).ToLocalChecked(), v8::String::NewFromUtf8(isolate, "index.html", v8::NewStringType::kNormal).ToLocalChecked());
+    t = request->Set(context, v8::String::NewFromUtf8(isolate, "bodyStreamed", v8::NewStringType::kNormal).ToLocalChecked(), v8::False(isolate));
+    (void)t;
+    return request;
+}
+
+static int oldRequest(v8::Isolate *isolate, v8::Local<v8::Context> context, int socket) {
+    v8::HandleScope scope(isolate);
+    oldObject(isolate, context, socket);
+    // status, header, write and close each looked the socket up
+    int found = 0;
+    for (int i = 0; i < 4; i++) {
+        found += globalSocket(isolate, context);
+    }
+    return found;
+}
+
+// sets the same five properties as the old way, not leaving bodyStreamed to the template
+static v8::Local<v8::Object> newObject(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::ObjectTemplate> instance, v8::Eternal<v8::String> *keys, int socket) {
+    v8::Local<v8::Object> request = instance->NewInstance(context).ToLocalChecked();
+    request->SetInternalField(0, v8::Int32::New(isolate, socket));
+    auto t = request->Set(context, keys[KEY_SOCKET].Get(isolate), v8::Int32::New(isolate, socket));
+    t = request->Set(context, keys[KEY_METHOD].Get(isolate), v8::String::NewFromUtf8(isolate, "GET", v8::NewStringType::kInternalized).ToLocalChecked());
+    t = request->Set(context, keys[KEY_URI].Get(isolate), v8::String::NewFromUtf8(isolate, "/index.html?a=1", v8::NewStringType::kNormal).ToLocalChecked());
+    t = request->Set(context, keys[KEY_PATH].Get(isolate), v8::String::NewFromUtf8(isolate, "index.html", v8::NewStringType::kNormal).ToLocalChecked());
+    t = request->Set(context, keys[KEY_BODY_STREAMED].Get(isolate), v8::False(isolate));
+    (void)t;
+    return request;
+}
+
+static int newRequest(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::ObjectTemplate> instance, v8::Eternal<v8::String> *keys, int socket) {
+    v8::HandleScope scope(isolate);
+    v8::Local<v8::Object> request = newObject(isolate, context, instance, keys, socket);
+    int found = 0;
+    for (int i = 0; i < 4; i++) {
+        v8::Local<v8::Value> value = request->GetInternalField(0);
+        found += value->IsInt32() ? value.As<v8::Int32>()->Value() : -1;
+    }
+    return found;
+}
+
+int main(int argc, char *argv[]) {
+    const long requests = argc > 1 ? atol(argv[1]) : 1000000;
+
+    v8::V8::InitializeICUDefaultLocation(argv[0]);
+    v8::V8::InitializeExternalStartupData(argv[0]);
+    std::unique_ptr<v8::Platform> platform = v8::platform::NewDefaultPlatform();
+    v8::V8::InitializePlatform(platform.get());
+    v8::V8::Initialize();
+
+    v8::Isolate::CreateParams create_params;
+    create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+    v8::Isolate *isolate = v8::Isolate::New(create_params);
+    {
+        v8::Isolate::Scope isolate_scope(isolate);
+        v8::HandleScope handle_scope(isolate);
+        v8::Local<v8::Context> context = v8::Context::New(isolate);
+        v8::Context::Scope context_scope(context);
+
+        v8::Eternal<v8::String> keys[KEY_COUNT];
+        v8::Local<v8::ObjectTemplate> instance = v8::ObjectTemplate::New(isolate);
+        instance->SetInternalFieldCount(1);
+        for (int i = 0; i < KEY_COUNT; i++) {
+            v8::Local<v8::String> key = v8::String::NewFromUtf8(isolate, names[i], v8::NewStringType::kInternalized).ToLocalChecked();
+            keys[i].Set(isolate, key);
+            v8::Local<v8::Primitive> value = v8::Null(isolate);
+            if (i == KEY_BODY_STREAMED) {
+                value = v8::False(isolate);
+            }
+            instance->Set(key, value);
+        }
+
+        // both ways have to build the same request, or the timings compare different work
+        v8::Local<v8::Object> before = oldObject(isolate, context, 4);
+        v8::Local<v8::Object> after = newObject(isolate, context, instance, keys, 4);
+        for (int i = 0; i < KEY_COUNT; i++) {
+            v8::Local<v8::Value> expected = before->Get(context, keys[i].Get(isolate)).ToLocalChecked();
+            v8::Local<v8::Value> actual = after->Get(context, keys[i].Get(isolate)).ToLocalChecked();
+            if (!expected->StrictEquals(actual)) {
+                fprintf(stderr, "request objects differ in %s\n", names[i]);
+                return 1;
+            }
+        }
+        if (before->GetOwnPropertyNames(context).ToLocalChecked()->Length() != after->GetOwnPropertyNames(context).ToLocalChecked()->Length()) {
+            fprintf(stderr, "request objects differ in their properties\n");
+            return 1;
+        }
+
+        long check = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (long i = 0; i < requests; i++) {
+            check += oldRequest(isolate, context, 4 + (i & 1023));
+        }
+        double oldSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        begin = std::chrono::steady_clock::now();
+        for (long i = 0; i < requests; i++) {
+            check -= newRequest(isolate, context, instance, keys, 4 + (i & 1023));
+        }
+        double newSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        if (check != 0) {
+            fprintf(stderr, "sockets do not match\n");
+            return 1;
+        }
+        printf("%20s %12.1f ns/request\n", "global property", oldSeconds * 1e9 / requests);
+        printf("%20s %12.1f ns/request\n", "template and field", newSeconds * 1e9 / requests);
+        printf("%20s %11.2fx\n", "ratio", oldSeconds / newSeconds);
+    }
+    isolate->Dispose();
+    v8::V8::Dispose();
+    v8::V8::ShutdownPlatform();
+    delete create_params.array_buffer_allocator;
+    return 0;
+}
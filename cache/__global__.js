@@ -3,7 +3,9 @@
 // the result of this non module script MUST to be a function that will be called each time a request is made.
 // call signature is :
 // function(request)
-// where request is object like {socket, method, uri}
+// where request is object like {socket, method, uri, path, module, query, headers, body, bodyStreamed}
+// module is the handler script the server found for the path
+// the request object is passed to the core response functions; it knows its connection
 
 const { log, logError } = include('log.js');
 const { HttpRequest, HttpResponse } = include('http.js');
@@ -12,21 +14,18 @@ function emptyFuntion() {
     logError({ log: "empty function" });
 }
 
-function responseError501(result) {
-    const len = result.length;
-    core.socketWrite("HTTP/1.1 501 ERROR\r\n");
-    core.socketWrite("content-type: text/plain\r\n");
-    core.socketWrite("content-length: " + len + "\r\n\r\n");
-    core.socketWrite(result);
-    core.socketClose();
+function responseError(request, status, result) {
+    core.responseStatus(request, status);
+    core.responseHeader(request, "content-type", "text/plain");
+    core.socketWrite(request, result);
 }
 async function execute(request, urijs) {
     const handler = include(urijs);
     var error = "";
 
     if (typeof handler === 'object') {
-        const httpRequest = new HttpRequest(request.method, request.uri);
-        const httpResponse = new HttpResponse();
+        const httpRequest = new HttpRequest(request);
+        const httpResponse = new HttpResponse(request);
         if (handler.default) {
             const handlerDefault = handler.default;
             if ((typeof handlerDefault) === 'function') {
@@ -40,17 +39,24 @@ async function execute(request, urijs) {
         }
     }
 
-    responseError501("No Handler Implemented: " + error);
+    responseError(request, 501, "No Handler Implemented: " + error);
 }
 
 // main function for serving requests
 function serveRequest(request) {
-    const uri = request.uri;
-    const urijs = uri.split(".")[0] + ".js";
+    const urijs = request.module;
+    // the connection is released exactly once: kept alive after a response, closed after an error
     execute(request, urijs).then(
-        () => core.socketClose()
-    ).catch(function () {
-        () => core.socketClose()
+        () => core.socketClose(request)
+    ).catch(function (e) {
+        const error = (e && e.stack) ? e.stack : String(e);
+        logError({ error: error });
+        try {
+            // a streamed response is already on the way and can only be cut
+            responseError(request, 500, error);
+        } finally {
+            core.socketClose(request, true);
+        }
     });
 }
 
@@ -0,0 +1,7 @@
+// postgres round trip; /database.server?name=value
+export default async function requestHandler(request, response) {
+    const name = request.getQuery().name || "world";
+    const result = await core.pg.query(["SELECT $1::text AS name, now() AS time", name]);
+    response.setStatus(200);
+    response.send(JSON.stringify(result.rows));
+}
@@ -3,9 +3,42 @@ export const CONTENT_LENGTH = "content-length";
 export const CONTENT_TYPE = "content-type";
 
 export class HttpRequest {
-    constructor(method, uri) {
-        this.method = method;
-        this.uri = uri;
+    // request is the native one passed to serveRequest
+    constructor(request) {
+        // the native request identifies the connection in the core calls
+        this.native = request;
+        this.method = request.method;
+        this.uri = request.uri;
+        // decoded path and query parameters
+        this.path = request.path;
+        this.query = request.query || {};
+        // native headers; names are case insensitive and only the read values become strings
+        this.headers = request.headers || {};
+        this.body = request.body || null;
+        this.bodyStreamed = !!request.bodyStreamed;
+    }
+
+    // body received together with the request as ArrayBuffer; null when there is none or it is streamed
+    getBody() {
+        return this.body;
+    }
+
+    // body as ArrayBuffer chunks; works for received and for streamed bodies
+    // for await (const chunk of request) { ... }
+    async *chunks() {
+        if (this.body) {
+            yield this.body;
+        }
+        if (this.bodyStreamed) {
+            let chunk;
+            while ((chunk = await core.requestRead(this.native)) !== null) {
+                yield chunk;
+            }
+        }
+    }
+
+    [Symbol.asyncIterator]() {
+        return this.chunks();
     }
 
     getMethod() {
@@ -16,41 +49,29 @@ export class HttpRequest {
         return this.uri;
     }
 
+    getPath() {
+        return this.path;
+    }
+
+    // query parameters decoded natively
     getQuery() {
-        if (!this.query) {
-            const query = this.uri.substring(this.uri.split('?')[0].length + 1);
-            const vars = query.split('&');
-            const queryObject = {};
-            for (var i = 0; i < vars.length; i++) {
-                const currentVar = vars[i];
-                const key = currentVar.split('=')[0];
-                const value = currentVar.substring(key.length + 1);
-                queryObject[key] = value;
-            }
-            this.query = queryObject;
-        }
         return this.query;
     }
 
-    getHeader() {
-        if (!this.header) {
-            const headerObject = {};
-            const headerLines = core.socketHeader().trim().split('\n');
-            for (var i = 0; i < headerLines.length; i++) {
-                const currentHeaderLine = headerLines[i];
-                const key = currentHeaderLine.split(':')[0];
-                const value = currentHeaderLine.substring(key.length + 1).trim();
-                headerObject[key] = value;
-            }
-            this.header = headerObject;
+    // value of the header with the name; all headers when called without a name
+    getHeader(name) {
+        if (name === undefined) {
+            return this.headers;
         }
-        return this.header;
+        return this.headers[name];
     }
 }
 
 export class HttpResponse {
 
-    constructor() {
+    // request is the native one passed to serveRequest
+    constructor(request) {
+        this.native = request;
         this.header = {};
         this.statusCode = 200;
         this.contentType = 'application/json';
@@ -83,26 +104,48 @@ export class HttpResponse {
 
     sendHeader() {
         for (const key in this.header) {
-            core.socketWrite(key + ": " + this.header[key] + "\r\n");
+            core.responseHeader(this.native, key, this.header[key]);
         }
-        // separator
-        core.socketWrite("\r\n");
         return this;
     }
 
     send(buffer) {
-        // http protocol
-        const http = "HTTP/1.1 " + this.statusCode + " " + ((this.statusCode == 200) ? "OK" : "ERROR") + "\r\n";
-        core.socketWrite(http);
-        //http header
+        // status, header and content are collected natively and sent in one go when the request completes
+        core.responseStatus(this.native, this.statusCode);
         if (this.contentType) {
             this.header[CONTENT_TYPE] = this.contentType;
         }
-        if (!this.header[CONTENT_LENGTH]) {
-            this.header[CONTENT_LENGTH] = core.getBytesLength(buffer);
-        }
+        // content-length is added natively when it is not set
         this.sendHeader();
         //send content
-        core.socketWrite(buffer);
+        core.socketWrite(this.native, buffer);
+    }
+
+    // streaming: the header goes out with the first write, then every write is sent as a chunk
+    // await it to follow the pace of the client
+    async write(chunk) {
+        if (!this.streaming) {
+            core.responseStatus(this.native, this.statusCode);
+            if (this.contentType) {
+                this.header[CONTENT_TYPE] = this.contentType;
+            }
+            this.sendHeader();
+            core.responseStream(this.native);
+            this.streaming = true;
+        }
+        if (!core.socketWrite(this.native, chunk)) {
+            await core.responseDrain(this.native);
+        }
+        return this;
+    }
+
+    // the last chunk is sent when the handler completes
+    async end(chunk) {
+        if (chunk !== undefined) {
+            await this.write(chunk);
+        } else if (!this.streaming) {
+            this.send("");
+        }
+        return this;
     }
 }
\ No newline at end of file
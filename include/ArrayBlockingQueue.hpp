@@ -45,8 +45,7 @@ template <typename E> class ArrayBlockingQueue {
         count = 0;
     }
 
-    // create queue with given size
-    ~ArrayBlockingQueue() { delete queueItems; }
+    ~ArrayBlockingQueue() { delete[] queueItems; }
 
     // add element to the queue; blocks if queue is full
     void enqueue(E *e) {
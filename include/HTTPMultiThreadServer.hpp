@@ -1,64 +1,157 @@
 #pragma once
 
-#include "ArrayBlockingQueue.hpp"
+#include "HTTPParser.hpp"
+#include "HTTPURL.hpp"
+#include "MPMCQueue.hpp"
 #include <arpa/inet.h>
+#include <map>
+#include <mutex>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 
 namespace util {
 
+// parsed request; owns the bytes it was received in and exposes views over them
 class HTTPRequest {
   public:
     int socket;
-    char *method;
-    char *uri;
+    std::string buffer;
+    std::string_view method;
+    std::string_view uri;
+    // decoded uri without the leading slash and the query
+    std::string_view path;
+    HTTPURL url;
+    std::string_view header;
+    std::string_view body;
+    std::vector<HTTPHeader> headers;
+    bool keepAlive;
+    // a streamed body is still on the socket; bodyRest holds what of it was already received
+    bool bodyStreamed;
+    std::string bodyRest;
+    HTTPBodyDecoder bodyDecoder;
 
     HTTPRequest() {
         socket = -1;
-        method = nullptr;
-        uri = nullptr;
+        keepAlive = false;
+        bodyStreamed = false;
     }
 
-    ~HTTPRequest() {
-        socket = -1;
-        delete[] method;
-        delete[] uri;
-    }
+    ~HTTPRequest() { socket = -1; }
 
-    HTTPRequest(int _socket, char *_method, char *_uri) {
+    // the buffer is taken over, so the views produced by the parser stay valid for the request lifetime
+    HTTPRequest(int _socket, std::string &&_buffer, HTTPParser &parser) : buffer(std::move(_buffer)) {
         socket = _socket;
-        {
-            int len = strlen(_method);
-            method = new char[len];
-            strcpy(method, _method);
+        const char *data = buffer.data();
+        method = parser.method(data);
+        uri = parser.uri(data);
+        header = parser.head(data);
+        body = parser.body(data);
+        parser.headers(data, headers);
+        bodyStreamed = parser.isStreamed();
+        if (bodyStreamed) {
+            bodyDecoder.start(parser.getContentLength(), parser.isChunked(), parser.getBodyLimit());
         }
-        {
-            int len = strlen(_uri);
-            uri = new char[len];
-            strcpy(uri, _uri);
+        // HTTP/1.1 connections are persistent unless closed explicitly; HTTP/1.0 ones only on request
+        std::string_view connection = getHeader("connection");
+        if (parser.version(data) == "HTTP/1.1") {
+            keepAlive = !HTTPParser::equalsIgnoreCase(connection, "close");
+        } else {
+            keepAlive = HTTPParser::equalsIgnoreCase(connection, "keep-alive");
         }
     }
 
-    HTTPRequest &operator=(const HTTPRequest &_request) {
-        socket = _request.socket;
-        uri = _request.uri;
-        {
-            delete[] method;
-            int len = strlen(_request.method);
-            method = new char[len];
-            strcpy(method, _request.method);
+    // get header value by case insensitive name; empty if missing
+    std::string_view getHeader(std::string_view name) {
+        for (const HTTPHeader &h : headers) {
+            if (HTTPParser::equalsIgnoreCase(h.name, name)) {
+                return h.value;
+            }
         }
-        {
-            delete[] uri;
-            int len = strlen(_request.uri);
-            uri = new char[len];
-            strcpy(uri, _request.uri);
+        return std::string_view();
+    }
+
+    HTTPRequest &operator=(const HTTPRequest &) = delete;
+};
+
+// copy of the request headers that outlives the request buffer; the fields are offsets into the copied head
+class HTTPHeaders {
+  private:
+    struct Field {
+        HTTPSpan name;
+        HTTPSpan value;
+    };
+    std::string text;
+    std::vector<Field> fields;
+
+  public:
+    HTTPHeaders() {}
+
+    ~HTTPHeaders() {}
+
+    // head is the raw header text the headers point into
+    void assign(std::string_view head, const std::vector<HTTPHeader> &headers) {
+        text.assign(head);
+        fields.clear();
+        fields.reserve(headers.size());
+        for (const HTTPHeader &h : headers) {
+            fields.push_back({{(size_t)(h.name.data() - head.data()), h.name.length()}, {(size_t)(h.value.data() - head.data()), h.value.length()}});
+        }
+    }
+
+    size_t size() { return fields.size(); }
+    std::string_view name(size_t i) { return std::string_view(text.data() + fields[i].name.offset, fields[i].name.length); }
+    std::string_view value(size_t i) { return std::string_view(text.data() + fields[i].value.offset, fields[i].value.length); }
+
+    // value of the first header with the case insensitive name
+    bool get(std::string_view headerName, std::string_view &headerValue) {
+        for (size_t i = 0; i < fields.size(); i++) {
+            if (HTTPParser::equalsIgnoreCase(name(i), headerName)) {
+                headerValue = value(i);
+                return true;
+            }
         }
-        return *this;
+        return false;
+    }
+
+    void swap(HTTPHeaders &other) {
+        text.swap(other.text);
+        fields.swap(other.fields);
     }
+
+    HTTPHeaders &operator=(const HTTPHeaders &) = delete;
+};
+
+// state of a connection between requests; buffer holds what is received but not yet dispatched
+class HTTPConnection {
+  public:
+    int socket;
+    int epoll;
+    bool keepAlive;
+    // the request body is read by the handler; the connection can be kept only once it is read to the end
+    bool bodyPending;
+    std::string buffer;
+    HTTPParser parser;
+
+    HTTPConnection(int _socket, int _epoll, size_t bodyLimit) {
+        socket = _socket;
+        epoll = _epoll;
+        keepAlive = false;
+        bodyPending = false;
+        parser.setBodyLimit(bodyLimit);
+    }
+
+    ~HTTPConnection() {}
+
+    HTTPConnection &operator=(const HTTPConnection &) = delete;
 };
 
 typedef void (*handler_type)(HTTPRequest *, void *context);
@@ -67,32 +160,47 @@ class HTTPMultiThreadServer {
 
 #define METHOD_LIMIT 100
 #define URI_LIMIT 4096
+#define READ_CHUNK 4096
+#define EPOLL_EVENTS 256
 
   private:
     int port;
     int server_socket;
     int handlers_count;
     std::thread *handlers;
+    int event_threads_count;
+    std::thread *event_threads;
+    int *epolls;
     bool initialized;
     const char *error;
-    util::ArrayBlockingQueue<HTTPRequest> requestQueue;
+    util::MPMCQueue<HTTPRequest> requestQueue;
+    // connections with a request in flight; they are out of the event loop until released
+    std::mutex connectionsMutex;
+    std::map<int, HTTPConnection *> connections;
     handler_type requestHandler;
     void *requestHandlerContext;
+    size_t bodyLimit;
 
   public:
     bool isInitialized() { return initialized; }
     const char *getError() { return error; }
 
     // init the server
-    HTTPMultiThreadServer(unsigned int port, int thread_count, int requestQueueSize) : requestQueue(requestQueueSize) {
+    HTTPMultiThreadServer(unsigned int port, int thread_count, int requestQueueSize, int event_thread_count = 1) : requestQueue(requestQueueSize) {
         initialized = false;
         this->port = port;
+        bodyLimit = HTTP_BODY_LIMIT;
         error = nullptr;
+        handlers = nullptr;
+        event_threads = nullptr;
+        epolls = nullptr;
         if (thread_count <= 0) {
             error = "thread_count must be positive number";
+        } else if (event_thread_count <= 0) {
+            error = "event_thread_count must be positive number";
         } else {
             // Create socket
-            server_socket = socket(AF_INET, SOCK_STREAM, 0);
+            server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
             if (server_socket == -1) {
                 error = "Could not create socket";
@@ -100,12 +208,16 @@ class HTTPMultiThreadServer {
                 struct sockaddr_in server;
                 server.sin_family = AF_INET;
                 server.sin_addr.s_addr = INADDR_ANY;
-                server.sin_port = htons(8888);
+                server.sin_port = htons(port);
+
+                int reuse = 1;
+                setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 
                 // Bind
                 if (bind(server_socket, (struct sockaddr *)&server, sizeof(server)) < 0) {
                     error = "bind failed.";
                 } else {
+                    event_threads_count = event_thread_count;
                     handlers_count = thread_count;
                     handlers = new std::thread[handlers_count];
                     if (handlers == nullptr) {
@@ -124,11 +236,21 @@ class HTTPMultiThreadServer {
 
     ~HTTPMultiThreadServer() {
         if (handlers != nullptr) {
-            delete handlers;
+            delete[] handlers;
+        }
+        if (event_threads != nullptr) {
+            delete[] event_threads;
+        }
+        if (epolls != nullptr) {
+            for (int i = 0; i < event_threads_count; i++) {
+                close(epolls[i]);
+            }
+            delete[] epolls;
         }
     }
 
     // start listening for connections and call the request handler
+    // the calling thread becomes one of the event threads and does not return until the event loop fails
     const char *startListening(handler_type handler, void *context) {
         if (!initialized) {
             return error = "not initialized properly";
@@ -139,52 +261,84 @@ class HTTPMultiThreadServer {
         requestHandler = handler;
         requestHandlerContext = context;
         // Listen
-        listen(server_socket, 1000);
-
-        int c = sizeof(struct sockaddr_in);
-        struct sockaddr_in client;
-        int client_socket;
-        // wait for connections
+        if (listen(server_socket, 1000) < 0) {
+            return error = "listen failed";
+        }
 
-        fprintf(stderr, "{\"log\":\"Server started at port: %d\"}\r\n", port);
-        while ((client_socket = accept(server_socket, (struct sockaddr *)&client, (socklen_t *)&c))) {
-            char method[METHOD_LIMIT + 1];
-            char uri[URI_LIMIT + 1];
-
-            read(client_socket, method, ' ', METHOD_LIMIT);
-            read(client_socket, uri, ' ', URI_LIMIT);
-            read(client_socket, nullptr, '\n', URI_LIMIT);
-            // clear / from the beginning of the uri
-            char *uri_cleaned = uri;
-            while (*uri_cleaned == '/') {
-                uri_cleaned++;
+        // every event thread has its own epoll; the listening socket is shared with EPOLLEXCLUSIVE
+        // so a new connection wakes a single thread and stays on that thread until it is handed over
+        epolls = new int[event_threads_count];
+        for (int i = 0; i < event_threads_count; i++) {
+            epolls[i] = epoll_create1(EPOLL_CLOEXEC);
+            if (epolls[i] < 0) {
+                return error = "epoll_create failed";
             }
-            if (*uri_cleaned == '\0') {
-                // set default uri
-                uri_cleaned = uri;
-                strcpy(uri_cleaned, "index.html");
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+            event.data.ptr = nullptr;
+            if (epoll_ctl(epolls[i], EPOLL_CTL_ADD, server_socket, &event) < 0) {
+                return error = "epoll_ctl failed for the server socket";
             }
+        }
 
-            if (validateMethod(method, METHOD_LIMIT) && validateUri(uri_cleaned, URI_LIMIT - (uri_cleaned - uri))) {
-                HTTPRequest *request = new HTTPRequest(client_socket, method, uri_cleaned);
-                requestQueue.enqueue(request);
-            } else {
-                const char *result = "invalid resource request";
-                char response[512];
-                sprintf(response, "HTTP/1.1 418 I'm a teapot\r\nContent-type: text/html\r\nContent-Length: %ld\r\n\r\n%s", strlen(result), result);
-                write(client_socket, response, strlen(response));
-                close(client_socket);
-            }
+        fprintf(stderr, "{\"log\":\"Server started at port: %d\"}\r\n", port);
+        event_threads = new std::thread[event_threads_count];
+        for (int i = 1; i < event_threads_count; i++) {
+            event_threads[i] = std::thread(&threadEventLoop, this, epolls[i]);
+            event_threads[i].detach();
         }
+        return threadEventLoop(this, epolls[0]);
+    }
 
-        if (client_socket < 0) {
-            return error = "accept failed";
-        } else {
-            return nullptr;
+    // largest request body accepted; bigger ones are refused with 413
+    void setBodyLimit(size_t limit) { bodyLimit = limit; }
+
+    // blocks until there is a request; the workers sleep on the queue futex instead of timing out
+    HTTPRequest *getRequest() { return requestQueue.dequeue(); }
+
+    // called once the response for the request on socket is written
+    // keep-alive connections go back to the event loop (or serve the next pipelined request), others are closed
+    void releaseConnection(int socket, bool forceClose = false) {
+        HTTPConnection *connection = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(connectionsMutex);
+            auto found = connections.find(socket);
+            if (found != connections.end()) {
+                connection = found->second;
+                connections.erase(found);
+            }
+        }
+        if (connection == nullptr) {
+            // already released
+            return;
+        }
+        if (forceClose || !connection->keepAlive || connection->bodyPending) {
+            close(socket);
+            delete connection;
+            return;
+        }
+        if (!connection->buffer.empty() && processBuffer(connection)) {
+            // next pipelined request is already dispatched
+            return;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(connection->epoll, EPOLL_CTL_ADD, socket, &event) < 0) {
+            close(socket);
+            delete connection;
         }
     }
 
-    HTTPRequest *getRequest() { return requestQueue.dequeue_for(std::chrono::milliseconds(100)); }
+    // the handler read a streamed request body to its end; unread are the bytes received after it
+    void bodyRead(int socket, std::string &&unread) {
+        std::unique_lock<std::mutex> lock(connectionsMutex);
+        auto found = connections.find(socket);
+        if (found != connections.end()) {
+            found->second->bodyPending = false;
+            found->second->buffer = std::move(unread);
+        }
+    }
 
     // no assignments allowed
     HTTPMultiThreadServer &operator=(const HTTPMultiThreadServer &) = delete;
@@ -207,89 +361,199 @@ class HTTPMultiThreadServer {
         }
     }
 
-    void read(int socket, char *buffer, char stopChar, int readlimit) {
-        int i = 0;
-        char c;
-        while ((recv(socket, &c, 1, 0)) > 0) {
-            if (c == stopChar) {
-                break;
-            }
-            if (buffer != nullptr) {
-                buffer[i] = c;
+    static const char *threadEventLoop(HTTPMultiThreadServer *server, int epoll) {
+        struct epoll_event events[EPOLL_EVENTS];
+        while (true) {
+            int n = epoll_wait(epoll, events, EPOLL_EVENTS, -1);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return server->error = "epoll_wait failed";
             }
-            i++;
-            if (i >= readlimit) {
-                break;
+            for (int i = 0; i < n; i++) {
+                HTTPConnection *connection = (HTTPConnection *)events[i].data.ptr;
+                if (connection == nullptr) {
+                    server->acceptConnections(epoll);
+                } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    server->closeConnection(connection);
+                } else {
+                    server->readConnection(connection);
+                }
             }
         }
-        if (buffer != nullptr) {
-            buffer[i] = 0;
-        }
     }
 
-    bool validateMethod(char *method, int limit) {
-        int i = 0;
-        while (i < limit) {
-            char c = method[i];
-            if (c == 0) {
-                break;
-            } else if (c < 'A' && 'Z' < c) {
-                return false;
+    // accept all pending connections; edge triggered so drain until EAGAIN
+    // sockets stay blocking for the handlers; the event loop reads them with MSG_DONTWAIT
+    void acceptConnections(int epoll) {
+        while (true) {
+            struct sockaddr_in client;
+            socklen_t c = sizeof(struct sockaddr_in);
+            int client_socket = accept4(server_socket, (struct sockaddr *)&client, &c, SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    fprintf(stderr, "Error: accept failed: %d - %s\n", errno, strerror(errno));
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            HTTPConnection *connection = new HTTPConnection(client_socket, epoll, bodyLimit);
+            struct epoll_event event;
+            event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+            event.data.ptr = connection;
+            if (epoll_ctl(epoll, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+                close(client_socket);
+                delete connection;
             }
-            i++;
         }
-        return i > 0;
     }
 
-#define VALID_URI_CHAR(C) (('a' <= (C) && (C) <= 'z') || ('A' <= (C) && (C) <= 'Z') || ('0' <= (C) && (C) <= '9') || (C) == '_' || (C) == '-')
-
-    // valid requests are small leters separated by / and the last is with extention
-    // example : /aaa/bbb/ccccc.xxx?whatEver^comes=next
-    bool validateUri(char *uri, int limit) {
-        int i = 0;
-        char prev;
-        char c = 0;
-        while (i < limit) {
-            prev = c;
-            c = uri[i];
-            if (c == 0) {
-                return i > 0;
-            } else if (c == '?') {
-                return prev != 0;
-            } else if (VALID_URI_CHAR(c)) {
-                // ok - continue checking
-            } else if (c == '/') {
-                if (prev == '/') {
-                    return false;
-                }
-            } else if (c == '.') {
-                // catch extention
-                if (VALID_URI_CHAR(prev)) {
-                    i++; // skip dot
-                    while (i < limit) {
-                        c = uri[i];
-                        if (c == 0) {
-                            return true;
-                        } else if (VALID_URI_CHAR(c)) {
-                            // ok - continue checking
-                        } else if (c == '?') {
-                            return true;
-                        } else {
-                            return false;
-                        }
-                        i++;
-                    }
-                    break;
-                } else {
-                    return false;
+    void closeConnection(HTTPConnection *connection) {
+        epoll_ctl(connection->epoll, EPOLL_CTL_DEL, connection->socket, nullptr);
+        close(connection->socket);
+        delete connection;
+    }
+
+    // read whatever is available straight into the connection buffer and hand over the request once it is complete
+    void readConnection(HTTPConnection *connection) {
+        std::string &buffer = connection->buffer;
+        while (true) {
+            const size_t length = buffer.length();
+            buffer.resize(length + READ_CHUNK);
+            ssize_t bytes = recv(connection->socket, &buffer[length], READ_CHUNK, MSG_DONTWAIT);
+            buffer.resize(length + (bytes > 0 ? bytes : 0));
+            if (bytes > 0) {
+                if (processBuffer(connection)) {
+                    return;
                 }
+            } else if (bytes < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // wait for the next edge
+                return;
             } else {
-                return false;
+                // closed by the peer or failed
+                closeConnection(connection);
+                return;
             }
-            i++;
+        }
+    }
+
+    // parse the buffered bytes; true if the connection left the event loop (dispatched or closed)
+    bool processBuffer(HTTPConnection *connection) {
+        HTTPParser::Result result = connection->parser.parse(connection->buffer.data(), connection->buffer.length());
+        if (result == HTTPParser::COMPLETE) {
+            dispatchRequest(connection);
+            return true;
+        } else if (result != HTTPParser::INCOMPLETE) {
+            responseInvalid(connection->socket, connection->parser.getError(), connection->parser.getStatus());
+            closeConnection(connection);
+            return true;
         }
         return false;
     }
+
+    // validate the parsed request and enqueue it
+    // the connection is parked until releaseConnection, so pipelined requests are served in order
+    void dispatchRequest(HTTPConnection *connection) {
+        const int socket = connection->socket;
+        epoll_ctl(connection->epoll, EPOLL_CTL_DEL, socket, nullptr);
+
+        // bytes after the request belong to the next pipelined one
+        std::string rest(connection->buffer, connection->parser.getEnd());
+        HTTPRequest *request = new HTTPRequest(socket, std::move(connection->buffer), connection->parser);
+        if (request->bodyStreamed) {
+            // these are the first bytes of the body, not of a next request
+            request->bodyRest = std::move(rest);
+            connection->buffer.clear();
+        } else {
+            connection->buffer = std::move(rest);
+        }
+        connection->parser.reset(0);
+        connection->keepAlive = request->keepAlive;
+        connection->bodyPending = request->bodyStreamed;
+
+        // clear / from the beginning of the uri
+        std::string_view &uri = request->uri;
+        while (!uri.empty() && uri.front() == '/') {
+            uri.remove_prefix(1);
+        }
+        const bool validUri = uri.length() <= URI_LIMIT && request->url.parse(uri);
+        request->path = request->url.getPath();
+        if (request->path.empty()) {
+            // set default uri
+            request->path = "index.html";
+        }
+        if (uri.empty()) {
+            uri = "index.html";
+        }
+
+        if (validateMethod(request->method, METHOD_LIMIT) && validUri) {
+            {
+                std::unique_lock<std::mutex> lock(connectionsMutex);
+                connections[socket] = connection;
+            }
+            // the event loop must not wait for the workers: with the queue full every connection of the thread would stall
+            if (!requestQueue.enqueue_nowait(request)) {
+                {
+                    std::unique_lock<std::mutex> lock(connectionsMutex);
+                    connections.erase(socket);
+                }
+                responseInvalid(socket, "server busy", 503);
+                close(socket);
+                delete connection;
+                delete request;
+            }
+        } else {
+            responseInvalid(socket, validUri ? "invalid resource request" : request->url.getError());
+            close(socket);
+            delete connection;
+            delete request;
+        }
+    }
+
+    // best effort from the event loop: a client that does not read gets nothing rather than stalling the loop; the connection is closed after
+    static void responseInvalid(int socket, const char *result, int status = 418) {
+        char response[512];
+        const int length = snprintf(response, sizeof(response), "HTTP/1.1 %d %s\r\nContent-type: text/html\r\nContent-Length: %zu\r\n\r\n%s", status, getReasonPhrase(status), strlen(result), result);
+        if (length > 0 && length < (int)sizeof(response)) {
+            send(socket, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+    }
+
+    static const char *getReasonPhrase(int status) {
+        switch (status) {
+        case 400:
+            return "Bad Request";
+        case 413:
+            return "Content Too Large";
+        case 418:
+            return "I'm a teapot";
+        case 431:
+            return "Request Header Fields Too Large";
+        case 501:
+            return "Not Implemented";
+        case 503:
+            return "Service Unavailable";
+        default:
+            return "Error";
+        }
+    }
+
+    bool validateMethod(std::string_view method, size_t limit) {
+        if (method.empty() || method.length() > limit) {
+            return false;
+        }
+        for (char c : method) {
+            if (c < 'A' || 'Z' < c) {
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
-} // namespace util
\ No newline at end of file
+} // namespace util
@@ -0,0 +1,449 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace util {
+
+// position of a token inside the receive buffer; kept as offsets so the buffer can grow while parsing
+struct HTTPSpan {
+    size_t offset;
+    size_t length;
+};
+
+struct HTTPHeader {
+    std::string_view name;
+    std::string_view value;
+};
+
+// incremental HTTP/1.1 request parser
+// call parse() every time new bytes are appended to the buffer; it resumes where it stopped
+// and never copies: the results are offsets into the buffer that are turned into views on demand
+class HTTPParser {
+
+#define HTTP_HEAD_LIMIT 16384
+#define HTTP_HEADERS_LIMIT 100
+#define HTTP_BODY_LIMIT (1024 * 1024)
+#define HTTP_BODY_PRELOAD_LIMIT (64 * 1024)
+
+  public:
+    enum Result { INCOMPLETE, COMPLETE, INVALID, TOO_LARGE };
+
+  private:
+    enum State { REQUEST_LINE, HEADERS, BODY, DONE };
+
+    struct HeaderSpan {
+        HTTPSpan name;
+        HTTPSpan value;
+    };
+
+    State state;
+    size_t start;    // where the current request starts in the buffer
+    size_t position; // where scanning resumes
+    size_t contentLength;
+    bool lengthSeen; // a content-length header came; repeating it is only fine with the same value
+    bool chunked;
+    bool streamed;      // the head is complete and the body is left on the socket for the handler
+    size_t bodyLimit;   // largest accepted body
+    size_t preloadLimit; // bigger bodies are not waited for
+    int status;
+    HTTPSpan methodSpan;
+    HTTPSpan uriSpan;
+    HTTPSpan versionSpan;
+    HTTPSpan headSpan;
+    HTTPSpan bodySpan;
+    std::vector<HeaderSpan> headerSpans;
+    const char *error;
+
+  public:
+    HTTPParser() : bodyLimit(HTTP_BODY_LIMIT), preloadLimit(HTTP_BODY_PRELOAD_LIMIT) { reset(0); }
+
+    ~HTTPParser() {}
+
+    // prepare for the next request starting at offset in the buffer
+    void reset(size_t offset) {
+        state = REQUEST_LINE;
+        start = offset;
+        position = offset;
+        contentLength = 0;
+        lengthSeen = false;
+        chunked = false;
+        streamed = false;
+        methodSpan = {offset, 0};
+        uriSpan = {offset, 0};
+        versionSpan = {offset, 0};
+        headSpan = {offset, 0};
+        bodySpan = {offset, 0};
+        headerSpans.clear();
+        error = nullptr;
+        status = 400;
+    }
+
+    void setBodyLimit(size_t limit) {
+        bodyLimit = limit;
+        preloadLimit = limit < HTTP_BODY_PRELOAD_LIMIT ? limit : HTTP_BODY_PRELOAD_LIMIT;
+    }
+
+    const char *getError() { return error; }
+    // response status that fits the error
+    int getStatus() { return status; }
+
+    // body is chunked or bigger than the preload limit; it is read with a body decoder after the request is dispatched
+    bool isStreamed() { return streamed; }
+    bool isChunked() { return chunked; }
+    size_t getContentLength() { return contentLength; }
+    size_t getBodyLimit() { return bodyLimit; }
+
+    // parse the bytes that were added since the last call
+    Result parse(const char *data, size_t length) {
+        while (state != DONE) {
+            if (state == BODY) {
+                if (length - position < contentLength) {
+                    return INCOMPLETE;
+                }
+                bodySpan = {position, contentLength};
+                position += contentLength;
+                state = DONE;
+                break;
+            }
+            const char *lineEnd = (const char *)memchr(data + position, '\n', length - position);
+            if (lineEnd == nullptr) {
+                if (length - start > HTTP_HEAD_LIMIT) {
+                    error = "request head too large";
+                    status = 431;
+                    return TOO_LARGE;
+                }
+                return INCOMPLETE;
+            }
+            size_t lineStart = position;
+            size_t next = lineEnd - data + 1;
+            size_t lineLength = next - 1 - lineStart;
+            if (lineLength > 0 && data[lineStart + lineLength - 1] == '\r') {
+                lineLength--;
+            }
+            position = next;
+
+            if (state == REQUEST_LINE) {
+                if (lineLength == 0) {
+                    // tolerate empty lines before the request line
+                    start = position;
+                    continue;
+                }
+                if (!parseRequestLine(data, lineStart, lineLength)) {
+                    return INVALID;
+                }
+                headSpan = {position, 0};
+                state = HEADERS;
+            } else if (lineLength == 0) {
+                // empty line ends the head
+                headSpan.length = lineStart - headSpan.offset;
+                if (contentLength > bodyLimit) {
+                    error = "request body too large";
+                    status = 413;
+                    return TOO_LARGE;
+                }
+                bodySpan = {position, 0};
+                if (chunked || contentLength > preloadLimit) {
+                    streamed = true;
+                    state = DONE;
+                    break;
+                }
+                state = BODY;
+            } else if (!parseHeader(data, lineStart, lineLength)) {
+                return INVALID;
+            }
+            if (position - start > HTTP_HEAD_LIMIT && state != BODY && state != DONE) {
+                error = "request head too large";
+                status = 431;
+                return TOO_LARGE;
+            }
+        }
+        return COMPLETE;
+    }
+
+    // offset right after the parsed request; pipelined requests start here
+    size_t getEnd() { return position; }
+
+    std::string_view method(const char *data) { return view(data, methodSpan); }
+    std::string_view uri(const char *data) { return view(data, uriSpan); }
+    std::string_view version(const char *data) { return view(data, versionSpan); }
+    // raw header lines without the request line and the terminating empty line
+    std::string_view head(const char *data) { return view(data, headSpan); }
+    std::string_view body(const char *data) { return view(data, bodySpan); }
+
+    void headers(const char *data, std::vector<HTTPHeader> &result) {
+        result.reserve(headerSpans.size());
+        for (const HeaderSpan &header : headerSpans) {
+            result.push_back({view(data, header.name), view(data, header.value)});
+        }
+    }
+
+    // case insensitive comparison of header names
+    static bool equalsIgnoreCase(std::string_view a, std::string_view b) { return a.length() == b.length() && strncasecmp(a.data(), b.data(), a.length()) == 0; }
+
+    // tchar of RFC 9110; header names and methods are made of these only
+    static bool isTokenChar(char c) { return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') || (c != 0 && strchr("!#$%&'*+-.^_`|~", c) != nullptr); }
+
+    static bool isToken(std::string_view text) {
+        if (text.empty()) {
+            return false;
+        }
+        for (char c : text) {
+            if (!isTokenChar(c)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // no assignments allowed
+    HTTPParser &operator=(const HTTPParser &) = delete;
+    HTTPParser &operator=(HTTPParser &&) = delete;
+
+  private:
+    static std::string_view view(const char *data, const HTTPSpan &span) { return std::string_view(data + span.offset, span.length); }
+
+    // METHOD SP URI SP HTTP/x.y
+    bool parseRequestLine(const char *data, size_t lineStart, size_t lineLength) {
+        const char *line = data + lineStart;
+        const char *end = line + lineLength;
+        const char *sp1 = (const char *)memchr(line, ' ', lineLength);
+        if (sp1 == nullptr || sp1 == line) {
+            error = "invalid request line";
+            return false;
+        }
+        const char *uriStart = sp1 + 1;
+        const char *sp2 = (const char *)memchr(uriStart, ' ', end - uriStart);
+        if (sp2 == nullptr || sp2 == uriStart) {
+            error = "invalid request line";
+            return false;
+        }
+        methodSpan = {lineStart, (size_t)(sp1 - line)};
+        uriSpan = {(size_t)(uriStart - data), (size_t)(sp2 - uriStart)};
+        versionSpan = {(size_t)(sp2 + 1 - data), (size_t)(end - sp2 - 1)};
+        if (versionSpan.length != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) {
+            error = "unsupported protocol version";
+            return false;
+        }
+        return true;
+    }
+
+    // NAME ":" OWS VALUE OWS
+    bool parseHeader(const char *data, size_t lineStart, size_t lineLength) {
+        if (headerSpans.size() >= HTTP_HEADERS_LIMIT) {
+            error = "too many headers";
+            return false;
+        }
+        const char *line = data + lineStart;
+        const char *colon = (const char *)memchr(line, ':', lineLength);
+        if (colon == nullptr || colon == line) {
+            error = "invalid header line";
+            return false;
+        }
+        size_t nameLength = colon - line;
+        // no whitespace before the colon either: "Content-Length : 5" must not slip through as another header
+        if (!isToken(std::string_view(line, nameLength))) {
+            error = "invalid header name";
+            return false;
+        }
+        size_t valueStart = nameLength + 1;
+        size_t valueEnd = lineLength;
+        while (valueStart < valueEnd && (line[valueStart] == ' ' || line[valueStart] == '\t')) {
+            valueStart++;
+        }
+        while (valueEnd > valueStart && (line[valueEnd - 1] == ' ' || line[valueEnd - 1] == '\t')) {
+            valueEnd--;
+        }
+        HeaderSpan header = {{lineStart, nameLength}, {lineStart + valueStart, valueEnd - valueStart}};
+        headerSpans.push_back(header);
+
+        std::string_view name(line, nameLength);
+        // a request framed in two ways, or in two lengths, could be read differently by a proxy in front (request smuggling)
+        if (equalsIgnoreCase(name, "content-length")) {
+            // DIGIT+ only: no sign, no inner spaces and no overflow
+            size_t length = 0;
+            if (valueStart == valueEnd) {
+                error = "invalid content-length";
+                return false;
+            }
+            for (size_t i = valueStart; i < valueEnd; i++) {
+                const char c = line[i];
+                if (c < '0' || c > '9' || length > (SIZE_MAX - (c - '0')) / 10) {
+                    error = "invalid content-length";
+                    return false;
+                }
+                length = length * 10 + (c - '0');
+            }
+            if (lengthSeen && length != contentLength) {
+                error = "conflicting content-length";
+                return false;
+            }
+            if (chunked) {
+                error = "content-length with transfer-encoding";
+                return false;
+            }
+            lengthSeen = true;
+            contentLength = length;
+        } else if (equalsIgnoreCase(name, "transfer-encoding")) {
+            // only chunked is decoded, so it has to be the one and only coding; repeated headers add to the list
+            if (chunked || !isOnlyChunked(std::string_view(line + valueStart, valueEnd - valueStart))) {
+                error = "unsupported transfer-encoding";
+                status = 501;
+                return false;
+            }
+            if (lengthSeen) {
+                error = "content-length with transfer-encoding";
+                return false;
+            }
+            chunked = true;
+        }
+        return true;
+    }
+
+    // coding list of a transfer-encoding: 1#( OWS coding OWS ) with empty elements allowed; true if it is chunked alone
+    static bool isOnlyChunked(std::string_view value) {
+        int codings = 0;
+        bool found = false;
+        while (!value.empty()) {
+            size_t comma = value.find(',');
+            std::string_view coding = value.substr(0, comma);
+            value = comma == std::string_view::npos ? std::string_view() : value.substr(comma + 1);
+            while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t')) {
+                coding.remove_prefix(1);
+            }
+            while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t')) {
+                coding.remove_suffix(1);
+            }
+            if (coding.empty()) {
+                continue;
+            }
+            codings++;
+            found = equalsIgnoreCase(coding, "chunked");
+        }
+        return codings == 1 && found;
+    }
+};
+
+// decoder of a request body that is read after the request is dispatched
+// framed by content-length or by chunked transfer encoding; fed with the received bytes in any pieces
+class HTTPBodyDecoder {
+  private:
+    enum State { LENGTH, CHUNK_SIZE, CHUNK_EXTENSION, CHUNK_DATA, CHUNK_DATA_END, TRAILER, DONE };
+
+    State state;
+    size_t remaining; // bytes left of the body or of the current chunk
+    size_t size;      // decoded so far
+    size_t limit;
+    size_t lineLength;
+    int digits;
+    const char *error;
+
+  public:
+    HTTPBodyDecoder() { start(0, false, HTTP_BODY_LIMIT); }
+
+    void start(size_t contentLength, bool chunked, size_t bodyLimit) {
+        state = chunked ? CHUNK_SIZE : (contentLength > 0 ? LENGTH : DONE);
+        remaining = chunked ? 0 : contentLength;
+        size = 0;
+        limit = bodyLimit;
+        lineLength = 0;
+        digits = 0;
+        error = nullptr;
+    }
+
+    bool isDone() { return state == DONE; }
+    size_t getSize() { return size; }
+    const char *getError() { return error; }
+
+    // decode from data; body bytes are appended to out and consumed tells how much of data belongs to the body
+    HTTPParser::Result decode(const char *data, size_t length, size_t &consumed, std::string &out) {
+        size_t i = 0;
+        while (i < length && state != DONE) {
+            if (state == LENGTH || state == CHUNK_DATA) {
+                size_t n = length - i < remaining ? length - i : remaining;
+                out.append(data + i, n);
+                i += n;
+                remaining -= n;
+                size += n;
+                if (remaining == 0) {
+                    state = (state == LENGTH) ? DONE : CHUNK_DATA_END;
+                }
+                continue;
+            }
+            const char c = data[i++];
+            if (state == CHUNK_SIZE) {
+                int digit = hexValue(c);
+                if (digit >= 0) {
+                    remaining = (remaining << 4) | digit;
+                    if (++digits > 15 || size + remaining > limit) {
+                        error = "request body too large";
+                        consumed = i;
+                        return HTTPParser::TOO_LARGE;
+                    }
+                } else if (digits > 0 && (c == ';' || c == ' ' || c == '\t' || c == '\r')) {
+                    state = CHUNK_EXTENSION;
+                } else if (digits > 0 && c == '\n') {
+                    endChunkSize();
+                } else {
+                    error = "invalid chunk size";
+                    consumed = i;
+                    return HTTPParser::INVALID;
+                }
+            } else if (state == CHUNK_EXTENSION) {
+                if (c == '\n') {
+                    endChunkSize();
+                } else if (++lineLength > HTTP_HEAD_LIMIT) {
+                    error = "chunk extension too large";
+                    consumed = i;
+                    return HTTPParser::INVALID;
+                }
+            } else if (state == CHUNK_DATA_END) {
+                if (c == '\n') {
+                    state = CHUNK_SIZE;
+                    digits = 0;
+                } else if (c != '\r') {
+                    error = "invalid chunk end";
+                    consumed = i;
+                    return HTTPParser::INVALID;
+                }
+            } else if (state == TRAILER) {
+                // trailer fields are skipped up to the empty line
+                if (c == '\n') {
+                    if (lineLength == 0) {
+                        state = DONE;
+                    }
+                    lineLength = 0;
+                } else if (c != '\r' && ++lineLength > HTTP_HEAD_LIMIT) {
+                    error = "chunk trailer too large";
+                    consumed = i;
+                    return HTTPParser::INVALID;
+                }
+            }
+        }
+        consumed = i;
+        return state == DONE ? HTTPParser::COMPLETE : HTTPParser::INCOMPLETE;
+    }
+
+  private:
+    void endChunkSize() {
+        lineLength = 0;
+        state = remaining == 0 ? TRAILER : CHUNK_DATA;
+    }
+
+    static int hexValue(char c) {
+        if ('0' <= c && c <= '9') {
+            return c - '0';
+        } else if ('a' <= c && c <= 'f') {
+            return c - 'a' + 10;
+        } else if ('A' <= c && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+};
+
+} // namespace util
@@ -0,0 +1,274 @@
+#pragma once
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "HTTPParser.hpp"
+
+namespace util {
+
+// response of one request built by the handler
+// status, headers and body are collected in memory and go to the socket with a single gathering write
+// when the response is done; big bodies are flushed on the way with MSG_MORE so the kernel still packs them
+// a streamed response sends the head right away and every flush as a chunk
+// no write blocks the isolate thread: what the socket does not take stays pending until the event loop finds
+// the socket writable, also after the response is complete (see isDrained)
+class HTTPResponse {
+
+#define RESPONSE_FLUSH_LIMIT (64 * 1024)
+#define RESPONSE_DIRECT_LIMIT (16 * 1024)
+#define RESPONSE_SCRATCH_LIMIT (1024 * 1024)
+
+  private:
+    std::string head;
+    std::string body;
+    bool started;    // status line is set; otherwise the bytes are written to the socket as they are
+    bool headSent;   // head is already on the wire, only body bytes can follow
+    bool hasLength;  // content-length was given by the handler
+    bool failed;
+    bool streaming; // flushes do not block; the rest waits in pending
+    bool chunked;   // streamed without content-length, so with chunked transfer encoding
+    std::string pending;
+    size_t pendingOffset;
+
+  public:
+    HTTPResponse() : started(false), headSent(false), hasLength(false), failed(false), streaming(false), chunked(false), pendingOffset(0) {}
+
+    ~HTTPResponse() {}
+
+    // start the response; anything collected and not yet sent is dropped
+    bool setStatus(int status, std::string_view reason) {
+        if (headSent || !isValidText(reason)) {
+            return false;
+        }
+        char line[32];
+        int len = snprintf(line, sizeof(line), "HTTP/1.1 %d ", status);
+        head.assign(line, len);
+        head.append(reason);
+        head.append("\r\n");
+        body.clear();
+        started = true;
+        hasLength = false;
+        streaming = false;
+        chunked = false;
+        return true;
+    }
+
+    // switch to streaming; the head goes out with the first flush
+    bool stream(int socket) {
+        if (!started || headSent) {
+            return false;
+        }
+        streaming = true;
+        chunked = !hasLength;
+        if (chunked) {
+            head.append("transfer-encoding: chunked\r\n");
+        }
+        return flush(socket, false);
+    }
+
+    bool isStreaming() { return streaming; }
+
+    // the handler may keep writing while less than the flush limit is waiting for the socket
+    bool isWritable() { return !failed && pending.length() - pendingOffset < RESPONSE_FLUSH_LIMIT; }
+
+    bool isDrained() { return failed || pendingOffset == pending.length(); }
+
+    // send what is pending as far as the socket takes it without blocking
+    bool sendPending(int socket) {
+        while (!failed && pendingOffset < pending.length()) {
+            ssize_t bytes = send(socket, pending.data() + pendingOffset, pending.length() - pendingOffset, MSG_DONTWAIT);
+            if (bytes > 0) {
+                pendingOffset += bytes;
+            } else if (bytes < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                fprintf(stderr, "Error: could not write to socket: %d - %s\n", errno, strerror(errno));
+                failed = true;
+            }
+        }
+        if (pendingOffset == pending.length()) {
+            pending.clear();
+            pendingOffset = 0;
+        }
+        return !failed;
+    }
+
+    // names have to be tokens and values can't hold line breaks, or a handler could end the head early (response splitting)
+    static bool isValidHeader(std::string_view name, std::string_view value) { return HTTPParser::isToken(name) && isValidText(value); }
+
+    // reason phrases and header values: no CR, LF or NUL
+    static bool isValidText(std::string_view text) { return text.find_first_of(std::string_view("\r\n\0", 3)) == std::string_view::npos; }
+
+    bool addHeader(std::string_view name, std::string_view value) {
+        if (!started || headSent || !isValidHeader(name, value)) {
+            return false;
+        }
+        if (HTTPParser::equalsIgnoreCase(name, "content-length")) {
+            hasLength = true;
+        }
+        head.append(name);
+        head.append(": ");
+        head.append(value);
+        head.append("\r\n");
+        return true;
+    }
+
+    // reserve space at the end of the body for length bytes and return where to put them
+    char *reserve(size_t length) {
+        size_t size = body.size();
+        body.resize(size + length);
+        return &body[size];
+    }
+
+    // give back what was reserved and not used
+    void shrink(size_t length) { body.resize(body.size() - length); }
+
+    void append(const char *data, size_t length) { body.append(data, length); }
+
+    // append bytes that stay valid only during the call; big ones go to the socket right from the caller memory
+    // together with what is collected before them, instead of being copied into the body
+    bool write(int socket, const char *data, size_t length) {
+        if (length < RESPONSE_DIRECT_LIMIT || streaming || (started && !headSent && !hasLength)) {
+            body.append(data, length);
+            return flushIfFull(socket);
+        }
+        return flush(socket, false, data, length);
+    }
+
+    // take over the buffer memory of a previous response
+    void adopt(std::string &scratch) {
+        body.swap(scratch);
+        body.clear();
+    }
+
+    // hand the buffer memory over to the next response unless it grew too big
+    void recycle(std::string &scratch) {
+        if (body.capacity() <= RESPONSE_SCRATCH_LIMIT && body.capacity() > scratch.capacity()) {
+            body.swap(scratch);
+        }
+    }
+
+    bool isFailed() { return failed; }
+
+    // write out what is collected when it gets big; the length must be known for the head to go first
+    bool flushIfFull(int socket) {
+        if (body.size() < RESPONSE_FLUSH_LIMIT || (started && !headSent && !hasLength && !streaming)) {
+            return true;
+        }
+        return flush(socket, false);
+    }
+
+    // send everything collected so far and optionally extra bytes after it; last completes the response
+    // what the socket does not take is pending, the response is complete on the wire once it is drained
+    bool flush(int socket, bool last, const char *extra = nullptr, size_t extraLength = 0) {
+        if (failed) {
+            return false;
+        }
+        if (streaming) {
+            return flushStream(socket, last);
+        }
+        struct iovec iov[3];
+        int count = 0;
+        if (started && !headSent) {
+            if (!hasLength) {
+                char line[48];
+                int len = snprintf(line, sizeof(line), "content-length: %zu\r\n", body.size());
+                head.append(line, len);
+            }
+            head.append("\r\n");
+            iov[count].iov_base = &head[0];
+            iov[count].iov_len = head.length();
+            count++;
+        }
+        if (!body.empty()) {
+            iov[count].iov_base = &body[0];
+            iov[count].iov_len = body.length();
+            count++;
+        }
+        if (extraLength > 0) {
+            iov[count].iov_base = (void *)extra;
+            iov[count].iov_len = extraLength;
+            count++;
+        }
+        if (count > 0) {
+            sendVector(socket, iov, count, last ? 0 : MSG_MORE);
+        }
+        headSent = started;
+        head.clear();
+        body.clear();
+        return !failed;
+    }
+
+  private:
+    // write the buffers after what is pending without blocking; the part the socket does not take is copied to pending
+    void sendVector(int socket, struct iovec *iov, int count, int flags) {
+        size_t sent = 0;
+        if (sendPending(socket) && pending.empty()) {
+            struct msghdr message = {};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            while (true) {
+                ssize_t bytes = sendmsg(socket, &message, flags | MSG_DONTWAIT);
+                if (bytes >= 0) {
+                    sent = bytes;
+                } else if (errno == EINTR) {
+                    continue;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr, "Error: could not write to socket: %d - %s\n", errno, strerror(errno));
+                    failed = true;
+                }
+                break;
+            }
+        }
+        if (failed) {
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            if (sent >= iov[i].iov_len) {
+                sent -= iov[i].iov_len;
+                continue;
+            }
+            pending.append((const char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+            sent = 0;
+        }
+    }
+
+    // frame what is collected as a chunk after the pending bytes and push as much as possible
+    bool flushStream(int socket, bool last) {
+        if (!headSent) {
+            head.append("\r\n");
+            pending.append(head);
+            head.clear();
+            headSent = true;
+        }
+        if (chunked && !body.empty()) {
+            char line[24];
+            int len = snprintf(line, sizeof(line), "%zx\r\n", body.size());
+            pending.append(line, len);
+            pending.append(body);
+            pending.append("\r\n");
+        } else {
+            pending.append(body);
+        }
+        body.clear();
+        if (chunked && last) {
+            pending.append("0\r\n\r\n");
+        }
+        return sendPending(socket);
+    }
+
+  public:
+    // no assignments allowed
+    HTTPResponse &operator=(const HTTPResponse &) = delete;
+    HTTPResponse &operator=(HTTPResponse &&) = delete;
+};
+
+} // namespace util
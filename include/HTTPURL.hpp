@@ -0,0 +1,223 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HTTPParser.hpp"
+
+namespace util {
+
+// request target split into a percent-decoded path and query parameters in one pass
+// characters are classified with a lookup table, so runs of plain characters are copied at once
+class HTTPURL {
+
+#define URL_PATH 1  // taken as is in the path
+#define URL_QUERY 2 // taken as is in a query key or value
+
+  private:
+    struct Param {
+        HTTPSpan name;
+        HTTPSpan value;
+    };
+    std::string path;
+    std::string query; // decoded names and values one after another
+    std::vector<Param> params;
+    const char *error;
+
+    static const unsigned char *table() {
+        static unsigned char classes[256] = {0};
+        static bool initialized = [] {
+            for (int c = 'a'; c <= 'z'; c++) {
+                classes[c] = URL_PATH | URL_QUERY;
+            }
+            for (int c = 'A'; c <= 'Z'; c++) {
+                classes[c] = URL_PATH | URL_QUERY;
+            }
+            for (int c = '0'; c <= '9'; c++) {
+                classes[c] = URL_PATH | URL_QUERY;
+            }
+            // unreserved and sub-delims except the ones with a meaning in the query
+            for (const char *c = "-._~!$'()*,;:@"; *c; c++) {
+                classes[(unsigned char)*c] = URL_PATH | URL_QUERY;
+            }
+            for (const char *c = "&=+"; *c; c++) {
+                classes[(unsigned char)*c] = URL_PATH;
+            }
+            for (const char *c = "/?"; *c; c++) {
+                classes[(unsigned char)*c] = URL_QUERY;
+            }
+            return true;
+        }();
+        (void)initialized;
+        return classes;
+    }
+
+  public:
+    HTTPURL() : error(nullptr) {}
+
+    ~HTTPURL() {}
+
+    // parse the target without its leading slashes; false if it is not acceptable
+    // segments starting with a dot (also encoded), empty segments and encoded slashes are refused so the path can name a resource directly
+    bool parse(std::string_view uri) {
+        const unsigned char *classes = table();
+        const char *data = uri.data();
+        const size_t length = uri.length();
+        path.clear();
+        query.clear();
+        params.clear();
+        error = nullptr;
+        path.reserve(length);
+
+        size_t i = 0;
+        size_t segment = 0;
+        while (i < length) {
+            size_t run = i;
+            while (i < length && (classes[(unsigned char)data[i]] & URL_PATH)) {
+                i++;
+            }
+            path.append(data + run, i - run);
+            if (i >= length) {
+                break;
+            }
+            const char c = data[i];
+            if (c == '?') {
+                i++;
+                break;
+            } else if (c == '/') {
+                if (!checkSegment(segment, false)) {
+                    return false;
+                }
+                path.push_back('/');
+                segment = path.length();
+                i++;
+            } else if (c == '%') {
+                int value = decodeEscape(data, length, i);
+                if (value <= 0 || value == '/' || value == '\\') {
+                    error = "invalid escape in path";
+                    return false;
+                }
+                path.push_back((char)value);
+                i += 3;
+            } else {
+                error = "invalid character in path";
+                return false;
+            }
+        }
+        if (!checkSegment(segment, true)) {
+            return false;
+        }
+
+        query.reserve(length - i);
+        while (i < length) {
+            Param param;
+            param.name.offset = query.length();
+            if (!decodeComponent(data, length, i, true)) {
+                return false;
+            }
+            param.name.length = query.length() - param.name.offset;
+            param.value.offset = query.length();
+            if (i < length && data[i] == '=') {
+                i++;
+                if (!decodeComponent(data, length, i, false)) {
+                    return false;
+                }
+            }
+            param.value.length = query.length() - param.value.offset;
+            if (param.name.length > 0 || param.value.length > 0) {
+                params.push_back(param);
+            }
+            // skip the separator
+            i++;
+        }
+        return true;
+    }
+
+    const char *getError() { return error; }
+
+    // decoded path without the leading slash
+    const std::string &getPath() { return path; }
+
+    size_t size() { return params.size(); }
+    std::string_view name(size_t i) { return std::string_view(query.data() + params[i].name.offset, params[i].name.length); }
+    std::string_view value(size_t i) { return std::string_view(query.data() + params[i].value.offset, params[i].value.length); }
+
+  private:
+    bool checkSegment(size_t start, bool last) {
+        std::string_view segment(path.data() + start, path.length() - start);
+        if (segment.empty() && !last) {
+            error = "empty path segment";
+            return false;
+        }
+        // no hidden resources either: the code caches live in .codecache
+        if (!segment.empty() && segment.front() == '.') {
+            error = "dot segment in path";
+            return false;
+        }
+        return true;
+    }
+
+    // value of %XX at i; -1 if it is not one
+    static int decodeEscape(const char *data, size_t length, size_t i) {
+        if (i + 2 >= length) {
+            return -1;
+        }
+        int high = hexValue(data[i + 1]);
+        int low = hexValue(data[i + 2]);
+        if (high < 0 || low < 0) {
+            return -1;
+        }
+        return (high << 4) | low;
+    }
+
+    static int hexValue(char c) {
+        if ('0' <= c && c <= '9') {
+            return c - '0';
+        } else if ('a' <= c && c <= 'f') {
+            return c - 'a' + 10;
+        } else if ('A' <= c && c <= 'F') {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    // decode a query name or value up to '&' (or '=' for names) and append it to query
+    bool decodeComponent(const char *data, size_t length, size_t &i, bool name) {
+        const unsigned char *classes = table();
+        while (i < length) {
+            size_t run = i;
+            while (i < length && (classes[(unsigned char)data[i]] & URL_QUERY)) {
+                i++;
+            }
+            query.append(data + run, i - run);
+            if (i >= length) {
+                break;
+            }
+            const char c = data[i];
+            if (c == '&' || (c == '=' && name)) {
+                break;
+            } else if (c == '=') {
+                query.push_back(c);
+                i++;
+            } else if (c == '+') {
+                query.push_back(' ');
+                i++;
+            } else if (c == '%') {
+                int value = decodeEscape(data, length, i);
+                if (value <= 0) {
+                    error = "invalid escape in query";
+                    return false;
+                }
+                query.push_back((char)value);
+                i += 3;
+            } else {
+                error = "invalid character in query";
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+} // namespace util
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace util {
+
+// bounded lock free multi producer / multi consumer queue (Dmitry Vyukov's ring)
+// every slot carries a sequence number that tells whether it is free for the producer of a round
+// or filled for its consumer, so producers and consumers only contend on their own position counter
+// threads park on a futex only when the queue is empty or full and are woken only if somebody is parked
+template <typename E> class MPMCQueue {
+
+#define MPMC_CACHE_LINE 64
+#define MPMC_SPIN_LIMIT 64
+
+  private:
+    struct alignas(MPMC_CACHE_LINE) Slot {
+        std::atomic<size_t> sequence;
+        E *item;
+    };
+
+    Slot *slots;
+    size_t mask;
+    alignas(MPMC_CACHE_LINE) std::atomic<size_t> enqueuePosition;
+    alignas(MPMC_CACHE_LINE) std::atomic<size_t> dequeuePosition;
+    // futex words changed on every wake up and the number of threads that went parking on them since the last wake up
+    alignas(MPMC_CACHE_LINE) std::atomic<uint32_t> notEmpty;
+    std::atomic<uint32_t> consumersWaiting;
+    alignas(MPMC_CACHE_LINE) std::atomic<uint32_t> notFull;
+    std::atomic<uint32_t> producersWaiting;
+
+    bool put(E *e) {
+        size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+            if (diff == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    slot.item = e;
+                    slot.sequence.store(position + 1, std::memory_order_release);
+                    wake(notEmpty, consumersWaiting);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // full
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    E *get() {
+        size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        while (true) {
+            Slot &slot = slots[position & mask];
+            size_t sequence = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(position + 1);
+            if (diff == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    E *e = slot.item;
+                    slot.sequence.store(position + mask + 1, std::memory_order_release);
+                    wake(notFull, producersWaiting);
+                    return e;
+                }
+            } else if (diff < 0) {
+                // empty
+                return nullptr;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // the fence pairs with the one in park: either the parked thread sees the change or we see it parked
+    // the count is taken, so one wake up serves everybody parked so far and the next operations stay without a syscall
+    static void wake(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed) > 0) {
+            uint32_t count = waiting.exchange(0, std::memory_order_relaxed);
+            if (count > 0) {
+                word.fetch_add(1, std::memory_order_release);
+                syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+            }
+        }
+    }
+
+    // retry the operation and sleep on the futex word in between; timeout < 0 waits forever
+    // a thread does not take itself out of the count; a stale count costs one needless wake up at most
+    template <typename Operation> bool park(std::atomic<uint32_t> &word, std::atomic<uint32_t> &waiting, Operation operation, long long timeout) {
+        for (int spin = 0; spin < MPMC_SPIN_LIMIT; spin++) {
+            if (operation()) {
+                return true;
+            }
+        }
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        while (true) {
+            uint32_t value = word.load(std::memory_order_acquire);
+            waiting.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (operation()) {
+                return true;
+            }
+            struct timespec remaining;
+            struct timespec *wait = nullptr;
+            if (timeout >= 0) {
+                auto left = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0) {
+                    return false;
+                }
+                remaining.tv_sec = left / 1000000000;
+                remaining.tv_nsec = left % 1000000000;
+                wait = &remaining;
+            }
+            syscall(SYS_futex, (uint32_t *)&word, FUTEX_WAIT_PRIVATE, value, wait, nullptr, 0);
+        }
+    }
+
+  public:
+    // create queue with given size; rounded up to a power of two
+    MPMCQueue(unsigned int size) {
+        size_t capacity = 2;
+        while (capacity < size) {
+            capacity <<= 1;
+        }
+        slots = new Slot[capacity];
+        for (size_t i = 0; i < capacity; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+            slots[i].item = nullptr;
+        }
+        mask = capacity - 1;
+        enqueuePosition.store(0, std::memory_order_relaxed);
+        dequeuePosition.store(0, std::memory_order_relaxed);
+        notEmpty.store(0, std::memory_order_relaxed);
+        consumersWaiting.store(0, std::memory_order_relaxed);
+        notFull.store(0, std::memory_order_relaxed);
+        producersWaiting.store(0, std::memory_order_relaxed);
+    }
+
+    ~MPMCQueue() { delete[] slots; }
+
+    // add element to the queue; blocks if queue is full
+    void enqueue(E *e) {
+        park(notFull, producersWaiting, [&] { return put(e); }, -1);
+    }
+
+    // take element from the queue; blocks if queue is empty
+    E *dequeue() {
+        E *e = nullptr;
+        park(notEmpty, consumersWaiting, [&] { return (e = get()) != nullptr; }, -1);
+        return e;
+    }
+
+    // add element to the queue; blocks if queue is full
+    bool enqueue_for(E *e, const std::chrono::milliseconds &__rtime) {
+        return park(notFull, producersWaiting, [&] { return put(e); }, __rtime.count());
+    }
+
+    // take element from the queue; blocks if queue is empty
+    E *dequeue_for(const std::chrono::milliseconds &__rtime) {
+        E *e = nullptr;
+        park(notEmpty, consumersWaiting, [&] { return (e = get()) != nullptr; }, __rtime.count());
+        return e;
+    }
+
+    // take element from the queue; nullptr if queue is empty
+    E *dequeue_nowait() { return get(); }
+
+    // add element to the queue; false if queue is full
+    bool enqueue_nowait(E *e) { return put(e); }
+
+    // no assignments allowed
+    MPMCQueue &operator=(const MPMCQueue &) = delete;
+    MPMCQueue &operator=(MPMCQueue &&) = delete;
+};
+
+} // namespace util
@@ -0,0 +1,448 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <errno.h>
+#include <libpq-fe.h>
+#include <list>
+#include <stdlib.h>
+#include <string>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <vector>
+
+namespace util {
+
+// postgres type oids the results are decoded by
+#define PG_TYPE_BOOL 16
+#define PG_TYPE_INT8 20
+#define PG_TYPE_INT2 21
+#define PG_TYPE_INT4 23
+#define PG_TYPE_TEXT 25
+#define PG_TYPE_OID 26
+#define PG_TYPE_NAME 19
+#define PG_TYPE_JSON 114
+#define PG_TYPE_FLOAT4 700
+#define PG_TYPE_FLOAT8 701
+#define PG_TYPE_UNKNOWN 705
+#define PG_TYPE_BPCHAR 1042
+#define PG_TYPE_VARCHAR 1043
+#define PG_TYPE_UUID 2950
+#define PG_TYPE_JSONB 3802
+
+// query with its parameters in text format; tag identifies it in the result callback
+// statement is the id the SQL text is known by to its owner; the query runs as a statement prepared once per connection
+// for the id, so the same id must always come with the same text; 0 runs the text unprepared
+struct PGQuery {
+    std::string sql;
+    std::vector<std::string> values;
+    std::vector<bool> nulls;
+    void *tag = nullptr;
+    uint32_t statement = 0;
+};
+
+// result callback; result is owned by the callee (PQclear), error is set instead when the query never got a result
+typedef void (*pg_result_type)(void *context, void *tag, PGresult *result, const char *error);
+
+// postgres connection in pipeline mode driven by the event loop of its owner with libpq's non-blocking API
+// every query is followed by its own sync, so it runs in its own implicit transaction and a failing one
+// does not abort the ones after it; queries sent before a flush go out together in one round trip
+// the socket is kept registered in the owner's epoll (for writing only while libpq has output pending)
+// prepared statements are kept in a least recently used cache of the connection; a statement is prepared
+// in the same round trip as its first execution and a new connection starts with an empty cache
+// the statement is described along, and once all its columns are of types decoded in binary (see isBinaryType)
+// its later executions ask for binary results; anything else comes in text format
+class PGConnection {
+
+#define PG_STATEMENT_CACHE 256
+#define PG_STATEMENT_PREFIX "uron_"
+#define PG_INVALID_STATEMENT "26000"
+#define PG_CONNECT_TIMEOUT 10000 // ms, unless connect_timeout is given in the conninfo
+
+  private:
+    struct Sent {
+        PGQuery query;
+        int steps; // groups of results still to come: 3 while the statement is prepared and described with the query
+    };
+    struct Statement {
+        std::string name;
+        int format; // of the results: 1 for binary
+        std::list<uint32_t>::iterator recent;
+    };
+    std::string conninfo;
+    int epoll;
+    PGconn *conn;
+    bool connecting;
+    bool writing; // libpq waits for the socket to be writable
+    int socket;   // registered in the epoll
+    uint32_t events;
+    std::deque<Sent> sent; // in flight, in the order of their results
+    size_t syncs;          // syncs sent and not yet received
+    PGresult *result;
+    std::string error;
+    std::chrono::steady_clock::time_point used;    // last query sent
+    std::chrono::steady_clock::time_point checked; // last query or health check sent
+    std::chrono::steady_clock::time_point deadline; // of connecting
+    std::unordered_map<uint32_t, Statement> statements; // by statement id of the queries
+    std::list<uint32_t> recent;                         // statement ids, most recently used first
+    unsigned long statementId;
+    pg_result_type callback;
+    void *context;
+
+  public:
+    PGConnection(const std::string &_conninfo, int _epoll, pg_result_type _callback, void *_context) : conninfo(_conninfo), epoll(_epoll), conn(nullptr), connecting(false), writing(false), socket(-1), events(0), syncs(0), result(nullptr), statementId(0), callback(_callback), context(_context) {}
+
+    ~PGConnection() { close(); }
+
+    // start connecting; false if that failed right away (see getError)
+    bool open() {
+        error.clear();
+        conn = PQconnectStart(conninfo.c_str());
+        if (conn == nullptr) {
+            broken("out of memory");
+            return false;
+        }
+        if (PQstatus(conn) == CONNECTION_BAD) {
+            broken(PQerrorMessage(conn));
+            return false;
+        }
+        // wait for the socket to be writable before the first poll
+        connecting = true;
+        writing = true;
+        used = checked = std::chrono::steady_clock::now();
+        deadline = used + std::chrono::milliseconds(connectTimeout());
+        watch();
+        return true;
+    }
+
+    bool isOpen() { return conn != nullptr; }
+
+    bool isConnecting() { return conn != nullptr && connecting; }
+
+    bool isReady() { return conn != nullptr && !connecting; }
+
+    int getSocket() { return socket; }
+
+    // queries sent and waiting for their results
+    size_t inFlight() { return sent.size(); }
+
+    // why the connection was closed; empty if it was closed on purpose
+    const std::string &getError() { return error; }
+
+    std::chrono::steady_clock::time_point getUsed() { return used; }
+
+    std::chrono::steady_clock::time_point getChecked() { return checked; }
+
+    std::chrono::steady_clock::time_point getDeadline() { return deadline; }
+
+    // close the connection when it is still connecting at its deadline; true if it did
+    bool expire(std::chrono::steady_clock::time_point now) {
+        if (!isConnecting() || now < deadline) {
+            return false;
+        }
+        broken("connection to database timed out");
+        return true;
+    }
+
+    // types with a binary format that is cheaper to read than their text and decoded by the result (see PGResult)
+    static bool isBinaryType(Oid type) {
+        switch (type) {
+        case PG_TYPE_BOOL:
+        case PG_TYPE_INT8:
+        case PG_TYPE_INT2:
+        case PG_TYPE_INT4:
+        case PG_TYPE_TEXT:
+        case PG_TYPE_OID:
+        case PG_TYPE_NAME:
+        case PG_TYPE_JSON:
+        case PG_TYPE_FLOAT4:
+        case PG_TYPE_FLOAT8:
+        case PG_TYPE_UNKNOWN:
+        case PG_TYPE_BPCHAR:
+        case PG_TYPE_VARCHAR:
+        case PG_TYPE_UUID:
+        case PG_TYPE_JSONB:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // queue the query in the pipeline; it goes out with the next flush
+    bool send(PGQuery &&query) {
+        const Statement *statement = nullptr;
+        int steps = 1;
+        if (query.statement != 0) {
+            statement = findStatement(query.statement);
+            if (statement == nullptr) {
+                statement = prepareStatement(query.statement, query.sql);
+                steps = 3;
+            }
+            if (statement == nullptr) {
+                // the connection broke while preparing
+                callback(context, query.tag, nullptr, error.c_str());
+                return false;
+            }
+        }
+        sent.push_back({std::move(query), steps});
+        PGQuery &next = sent.back().query;
+        const int count = next.values.size();
+        std::vector<const char *> values(count);
+        for (int i = 0; i < count; i++) {
+            values[i] = next.nulls[i] ? nullptr : next.values[i].c_str();
+        }
+        const int queued = statement != nullptr ? PQsendQueryPrepared(conn, statement->name.c_str(), count, values.data(), nullptr, nullptr, statement->format) : PQsendQueryParams(conn, next.sql.c_str(), count, nullptr, values.data(), nullptr, nullptr, 0);
+        if (!queued || !PQpipelineSync(conn)) {
+            broken(PQerrorMessage(conn));
+            return false;
+        }
+        syncs++;
+        used = checked = std::chrono::steady_clock::now();
+        return true;
+    }
+
+    // push what libpq buffered as far as the socket takes it
+    bool flush() {
+        if (conn == nullptr || connecting) {
+            return false;
+        }
+        const int flushed = PQflush(conn);
+        if (flushed < 0) {
+            broken(PQerrorMessage(conn));
+            return false;
+        }
+        writing = flushed > 0;
+        watch();
+        return true;
+    }
+
+    // the socket is ready: go on connecting, sending and reading results
+    void process() {
+        if (conn == nullptr) {
+            return;
+        }
+        if (connecting) {
+            connectPoll();
+            return;
+        }
+        if (writing && !flush()) {
+            return;
+        }
+        if (!PQconsumeInput(conn)) {
+            broken(PQerrorMessage(conn));
+            return;
+        }
+        readResults();
+    }
+
+    // fail what is in flight and close; the socket leaves the epoll before libpq closes it
+    void close() {
+        if (socket >= 0) {
+            epoll_ctl(epoll, EPOLL_CTL_DEL, socket, nullptr);
+            socket = -1;
+            events = 0;
+        }
+        if (result != nullptr) {
+            PQclear(result);
+            result = nullptr;
+        }
+        if (conn != nullptr) {
+            PQfinish(conn);
+            conn = nullptr;
+        }
+        connecting = false;
+        writing = false;
+        syncs = 0;
+        statements.clear();
+        recent.clear();
+        std::deque<Sent> failed;
+        failed.swap(sent);
+        const char *message = error.empty() ? "connection to database closed" : error.c_str();
+        for (Sent &query : failed) {
+            callback(context, query.query.tag, nullptr, message);
+        }
+    }
+
+  private:
+    // statement prepared for the id; null if it is not prepared yet
+    const Statement *findStatement(uint32_t id) {
+        auto found = statements.find(id);
+        if (found == statements.end()) {
+            return nullptr;
+        }
+        recent.splice(recent.begin(), recent, found->second.recent);
+        return &found->second;
+    }
+
+    // queue the PREPARE and its DESCRIBE in front of the query; the least recently used statement is deallocated when the cache is full
+    const Statement *prepareStatement(uint32_t id, const std::string &sql) {
+        if (statements.size() >= PG_STATEMENT_CACHE) {
+            auto evicted = statements.find(recent.back());
+            PGQuery deallocate;
+            deallocate.sql = "DEALLOCATE " + evicted->second.name;
+            recent.pop_back();
+            statements.erase(evicted);
+            sent.push_back({std::move(deallocate), 1});
+            if (!PQsendQueryParams(conn, sent.back().query.sql.c_str(), 0, nullptr, nullptr, nullptr, nullptr, 0) || !PQpipelineSync(conn)) {
+                broken(PQerrorMessage(conn));
+                return nullptr;
+            }
+            syncs++;
+        }
+        std::string name(PG_STATEMENT_PREFIX + std::to_string(++statementId));
+        if (!PQsendPrepare(conn, name.c_str(), sql.c_str(), 0, nullptr) || !PQsendDescribePrepared(conn, name.c_str())) {
+            broken(PQerrorMessage(conn));
+            return nullptr;
+        }
+        recent.push_front(id);
+        Statement &statement = statements[id];
+        statement.name = std::move(name);
+        statement.format = 0;
+        statement.recent = recent.begin();
+        return &statement;
+    }
+
+    // the first execution is already on its way in text format; the later ones are binary if all the columns can be
+    void describeStatement(uint32_t id, PGresult *description) {
+        auto found = statements.find(id);
+        if (found == statements.end()) {
+            return;
+        }
+        const int fieldCount = PQnfields(description);
+        for (int f = 0; f < fieldCount; f++) {
+            if (!isBinaryType(PQftype(description, f))) {
+                return;
+            }
+        }
+        found->second.format = 1;
+    }
+
+    // the statement is gone when preparing it failed or the server does not know it (anymore)
+    void forgetStatement(uint32_t id) {
+        auto found = statements.find(id);
+        if (found != statements.end()) {
+            recent.erase(found->second.recent);
+            statements.erase(found);
+        }
+    }
+
+    void connectPoll() {
+        switch (PQconnectPoll(conn)) {
+        case PGRES_POLLING_READING:
+            writing = false;
+            break;
+        case PGRES_POLLING_WRITING:
+            writing = true;
+            break;
+        case PGRES_POLLING_OK:
+            connecting = false;
+            writing = false;
+            if (PQsetnonblocking(conn, 1) != 0 || !PQenterPipelineMode(conn)) {
+                broken(PQerrorMessage(conn));
+                return;
+            }
+            break;
+        default:
+            broken(PQerrorMessage(conn));
+            return;
+        }
+        watch();
+    }
+
+    // the results of a query end with a null one and are followed by its sync; a PREPARE and DESCRIBE sent with it end the same way before
+    // the first error or else the last result is the one of the query, so a failed PREPARE is reported instead of the aborted query
+    void readResults() {
+        while ((!sent.empty() || syncs > 0) && !PQisBusy(conn)) {
+            PGresult *next = PQgetResult(conn);
+            if (next == nullptr) {
+                if (sent.empty()) {
+                    break;
+                }
+                if (--sent.front().steps > 0) {
+                    if (result != nullptr && PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                        forgetStatement(sent.front().query.statement);
+                    } else if (result != nullptr && sent.front().steps == 1) {
+                        describeStatement(sent.front().query.statement, result);
+                        PQclear(result);
+                        result = nullptr;
+                    }
+                    continue;
+                }
+                PGQuery query = std::move(sent.front().query);
+                sent.pop_front();
+                PGresult *done = result;
+                result = nullptr;
+                if (query.statement != 0 && done != nullptr && PQresultStatus(done) == PGRES_FATAL_ERROR) {
+                    const char *code = PQresultErrorField(done, PG_DIAG_SQLSTATE);
+                    if (code != nullptr && strcmp(code, PG_INVALID_STATEMENT) == 0) {
+                        forgetStatement(query.statement);
+                    }
+                }
+                callback(context, query.tag, done, done == nullptr ? "query returned no result" : nullptr);
+            } else if (PQresultStatus(next) == PGRES_PIPELINE_SYNC) {
+                PQclear(next);
+                syncs--;
+            } else if (result != nullptr && PQresultStatus(result) == PGRES_FATAL_ERROR) {
+                PQclear(next);
+            } else {
+                if (result != nullptr) {
+                    PQclear(result);
+                }
+                result = next;
+            }
+        }
+    }
+
+    // libpq does not apply connect_timeout to connections polled by the caller, so it is done here
+    long connectTimeout() {
+        long timeout = PG_CONNECT_TIMEOUT;
+        PQconninfoOption *options = PQconninfo(conn);
+        if (options == nullptr) {
+            return timeout;
+        }
+        for (PQconninfoOption *option = options; option->keyword != nullptr; option++) {
+            if (strcmp(option->keyword, "connect_timeout") == 0 && option->val != nullptr && atol(option->val) > 0) {
+                // libpq waits at least 2 seconds
+                timeout = std::max(atol(option->val), 2L) * 1000;
+            }
+        }
+        PQconninfoFree(options);
+        return timeout;
+    }
+
+    void broken(const char *message) {
+        error.assign(message != nullptr && *message ? message : "connection to database failed");
+        close();
+    }
+
+    // libpq may move to another socket while connecting; the old one is closed and gone from the epoll by then
+    void watch() {
+        const int current = conn != nullptr ? PQsocket(conn) : -1;
+        if (current < 0) {
+            socket = -1;
+            events = 0;
+            return;
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN | (writing ? (uint32_t)EPOLLOUT : 0);
+        event.data.fd = current;
+        if (current != socket) {
+            if (epoll_ctl(epoll, EPOLL_CTL_ADD, current, &event) < 0 && errno == EEXIST) {
+                epoll_ctl(epoll, EPOLL_CTL_MOD, current, &event);
+            }
+        } else if (event.events != events) {
+            epoll_ctl(epoll, EPOLL_CTL_MOD, current, &event);
+        }
+        socket = current;
+        events = event.events;
+    }
+
+  public:
+    // no assignments allowed
+    PGConnection &operator=(const PGConnection &) = delete;
+    PGConnection &operator=(PGConnection &&) = delete;
+};
+
+} // namespace util
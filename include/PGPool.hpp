@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "PGConnection.hpp"
+
+namespace util {
+
+// postgres connections of one isolate; only used from its event loop thread
+// queries wait in a bounded queue and are handed out when the loop calls dispatch(), so the queries made
+// during one round of the loop are pipelined together; each goes to the ready connection with the fewest
+// queries in flight, and a new connection is opened while all of them are busy and the pool is not full
+// idle connections get a health check now and then and are closed after a while, all but one; connecting
+// ones are given up at their deadline, failing the waiting queries when no other connection is left
+class PGPool {
+
+#define PG_POOL_SIZE 4
+#define PG_PIPELINE_DEPTH 32
+#define PG_POOL_QUEUE_LIMIT 1024
+#define PG_POOL_CHECK_INTERVAL 10000 // ms
+#define PG_POOL_IDLE_TIMEOUT 60000   // ms
+#define PG_POOL_BUCKETS 11
+#define PG_POOL_HEALTH_CHECK "SELECT 1"
+
+  private:
+    struct Waiting {
+        PGQuery query;
+        std::chrono::steady_clock::time_point queued;
+    };
+    std::string conninfo;
+    size_t size;
+    int epoll;
+    std::vector<PGConnection *> connections;
+    std::deque<Waiting> waiting;
+    pg_result_type callback;
+    void *context;
+    // time the queries waited for a connection in microseconds, by upper bound; the last bucket has no bound
+    uint64_t waitCounts[PG_POOL_BUCKETS];
+    uint64_t queries;
+    uint64_t rejected;
+
+  public:
+    PGPool(const std::string &_conninfo, size_t _size, int _epoll, pg_result_type _callback, void *_context) : conninfo(_conninfo), size(_size > 0 ? _size : PG_POOL_SIZE), epoll(_epoll), callback(_callback), context(_context), queries(0), rejected(0) {
+        for (int i = 0; i < PG_POOL_BUCKETS; i++) {
+            waitCounts[i] = 0;
+        }
+    }
+
+    ~PGPool() {
+        for (PGConnection *connection : connections) {
+            delete connection;
+        }
+    }
+
+    // queue the query until the next dispatch; false if the queue is full
+    bool query(PGQuery &&query) {
+        if (waiting.size() >= PG_POOL_QUEUE_LIMIT) {
+            rejected++;
+            return false;
+        }
+        waiting.push_back({std::move(query), std::chrono::steady_clock::now()});
+        return true;
+    }
+
+    // hand the waiting queries to the connections and send them
+    void dispatch() {
+        if (waiting.empty()) {
+            return;
+        }
+        grow();
+        const auto now = std::chrono::steady_clock::now();
+        while (!waiting.empty()) {
+            PGConnection *target = nullptr;
+            for (PGConnection *connection : connections) {
+                if (connection->isReady() && connection->inFlight() < PG_PIPELINE_DEPTH && (target == nullptr || connection->inFlight() < target->inFlight())) {
+                    target = connection;
+                }
+            }
+            if (target == nullptr) {
+                break;
+            }
+            Waiting &next = waiting.front();
+            countWait(std::chrono::duration_cast<std::chrono::microseconds>(now - next.queued).count());
+            queries++;
+            target->send(std::move(next.query));
+            waiting.pop_front();
+        }
+        for (PGConnection *connection : connections) {
+            connection->flush();
+        }
+        sweep();
+    }
+
+    // serve an event of the epoll; false if the socket is not one of the pool
+    bool process(int socket) {
+        for (PGConnection *connection : connections) {
+            if (connection->getSocket() == socket) {
+                connection->process();
+                sweep();
+                dispatch();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // connect deadlines, health checks and idle eviction; called from the event loop at least as often as nextTimeout() asks
+    void maintain() {
+        const auto now = std::chrono::steady_clock::now();
+        size_t open = connections.size();
+        for (PGConnection *connection : connections) {
+            if (connection->expire(now)) {
+                open--;
+                continue;
+            }
+            if (!connection->isReady() || connection->inFlight() > 0) {
+                continue;
+            }
+            if (open > 1 && now - connection->getUsed() >= std::chrono::milliseconds(PG_POOL_IDLE_TIMEOUT)) {
+                connection->close();
+                open--;
+            } else if (now - connection->getChecked() >= std::chrono::milliseconds(PG_POOL_CHECK_INTERVAL)) {
+                // a broken connection fails the check and is dropped; its result is not reported
+                PGQuery check;
+                check.sql = PG_POOL_HEALTH_CHECK;
+                if (connection->send(std::move(check))) {
+                    connection->flush();
+                }
+            }
+        }
+        sweep();
+    }
+
+    // milliseconds until maintain() has something to do; -1 if nothing
+    int nextTimeout() {
+        const auto now = std::chrono::steady_clock::now();
+        long long timeout = -1;
+        for (PGConnection *connection : connections) {
+            auto due = connection->getDeadline();
+            if (!connection->isConnecting()) {
+                if (!connection->isReady() || connection->inFlight() > 0) {
+                    continue;
+                }
+                due = connection->getChecked() + std::chrono::milliseconds(PG_POOL_CHECK_INTERVAL);
+                if (connections.size() > 1) {
+                    due = std::min(due, connection->getUsed() + std::chrono::milliseconds(PG_POOL_IDLE_TIMEOUT));
+                }
+            }
+            long long left = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+            left = left > 0 ? left : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+        return (int)timeout;
+    }
+
+    // the result callback of the connections; health checks and deallocations are not passed on
+    static void connectionResult(void *context, void *tag, PGresult *result, const char *error) {
+        PGPool *pool = (PGPool *)context;
+        if (tag == nullptr) {
+            PQclear(result);
+            return;
+        }
+        pool->callback(pool->context, tag, result, error);
+    }
+
+    size_t getSize() { return size; }
+    size_t getOpen() { return connections.size(); }
+    size_t getWaiting() { return waiting.size(); }
+    uint64_t getQueries() { return queries; }
+    uint64_t getRejected() { return rejected; }
+
+    // connections with queries in flight
+    size_t getInUse() {
+        size_t inUse = 0;
+        for (PGConnection *connection : connections) {
+            inUse += connection->inFlight() > 0 ? 1 : 0;
+        }
+        return inUse;
+    }
+
+    // upper bound of a wait time bucket in microseconds; 0 for the last one
+    static uint64_t getWaitBound(int bucket) {
+        static const uint64_t bounds[PG_POOL_BUCKETS] = {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000, 5000000, 0};
+        return bounds[bucket];
+    }
+
+    uint64_t getWaitCount(int bucket) { return waitCounts[bucket]; }
+
+  private:
+    // open one more connection while none is on the way and none of the ready ones is idle
+    void grow() {
+        if (connections.size() >= size) {
+            return;
+        }
+        for (PGConnection *connection : connections) {
+            if (connection->isConnecting() || connection->inFlight() == 0) {
+                return;
+            }
+        }
+        PGConnection *connection = new PGConnection(conninfo, epoll, connectionResult, this);
+        connections.push_back(connection);
+        connection->open();
+        sweep();
+    }
+
+    // drop closed connections; when the last one failed, the waiting queries fail with its error
+    void sweep() {
+        std::string error;
+        for (size_t i = 0; i < connections.size();) {
+            if (connections[i]->isOpen()) {
+                i++;
+                continue;
+            }
+            if (!connections[i]->getError().empty()) {
+                error = connections[i]->getError();
+            }
+            delete connections[i];
+            connections.erase(connections.begin() + i);
+        }
+        if (connections.empty() && !error.empty()) {
+            std::deque<Waiting> failed;
+            failed.swap(waiting);
+            for (Waiting &query : failed) {
+                callback(context, query.query.tag, nullptr, error.c_str());
+            }
+        }
+    }
+
+    void countWait(long long micros) {
+        int bucket = 0;
+        while (bucket < PG_POOL_BUCKETS - 1 && (uint64_t)micros > getWaitBound(bucket)) {
+            bucket++;
+        }
+        waitCounts[bucket]++;
+    }
+
+  public:
+    // no assignments allowed
+    PGPool &operator=(const PGPool &) = delete;
+    PGPool &operator=(PGPool &&) = delete;
+};
+
+} // namespace util
@@ -0,0 +1,340 @@
+#pragma once
+
+#define V8_COMPRESS_POINTERS
+#define V8_31BIT_SMIS_ON_64BIT_ARCH
+#include <v8.h>
+
+#include <endian.h>
+#include <libpq-fe.h>
+#include <math.h>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "PGConnection.hpp"
+
+namespace util {
+
+// result of a query as seen from JS; owns the PGresult for as long as the result object or one of its rows is reachable
+// numeric columns are decoded once into typed arrays (int2 and int4 to Int32Array, int8 to BigInt64Array, oid and floats
+// to Float64Array; NULL is 0 or NaN there) and the rows are objects of a template with interceptors that convert a cell
+// only when it is read, from the typed array or straight from the result in text or binary format
+class PGResult {
+
+#define PG_RESULT_FIELD_NATIVE 0
+#define PG_ROW_FIELD_RESULT 0
+#define PG_ROW_FIELD_INDEX 1
+#define PG_FIELD_NAME_LIMIT 256
+
+  public:
+    enum Kind { KIND_TEXT, KIND_BOOL, KIND_INT32, KIND_INT64, KIND_FLOAT64, KIND_UUID, KIND_JSONB };
+
+  private:
+    v8::Isolate *isolate;
+    PGresult *result;
+    int rowCount;
+    int fieldCount;
+    std::vector<Kind> kinds;
+    std::vector<std::shared_ptr<v8::BackingStore>> columns; // of the numeric fields, empty for the others
+    v8::Global<v8::Object> object;
+    int64_t memory; // reported to the isolate, so the GC knows what a result object holds on to
+
+    PGResult(v8::Isolate *_isolate, PGresult *_result) : isolate(_isolate), result(_result), rowCount(PQntuples(_result)), fieldCount(PQnfields(_result)), kinds(fieldCount), columns(fieldCount) {
+        for (int f = 0; f < fieldCount; f++) {
+            kinds[f] = toKind(PQftype(result, f));
+            size_t width = kinds[f] == KIND_INT32 ? sizeof(int32_t) : kinds[f] == KIND_INT64 ? sizeof(int64_t) : kinds[f] == KIND_FLOAT64 ? sizeof(double) : 0;
+            if (width > 0) {
+                columns[f] = v8::ArrayBuffer::NewBackingStore(isolate, width * rowCount);
+                decodeColumn(f);
+            }
+        }
+        memory = (int64_t)PQresultMemorySize(result);
+        isolate->AdjustAmountOfExternalAllocatedMemory(memory);
+    }
+
+    ~PGResult() {
+        isolate->AdjustAmountOfExternalAllocatedMemory(-memory);
+        PQclear(result);
+    }
+
+    // the first pass may only reset the handle; freeing the result and adjusting the external memory wait for the second
+    static void release(const v8::WeakCallbackInfo<PGResult> &info) {
+        info.GetParameter()->object.Reset();
+        info.SetSecondPassCallback(destroy);
+    }
+
+    static void destroy(const v8::WeakCallbackInfo<PGResult> &info) {
+        delete info.GetParameter();
+    }
+
+    static Kind toKind(Oid type) {
+        switch (type) {
+        case PG_TYPE_BOOL:
+            return KIND_BOOL;
+        case PG_TYPE_INT2:
+        case PG_TYPE_INT4:
+            return KIND_INT32;
+        case PG_TYPE_INT8:
+            return KIND_INT64;
+        case PG_TYPE_OID:
+        case PG_TYPE_FLOAT4:
+        case PG_TYPE_FLOAT8:
+            return KIND_FLOAT64;
+        case PG_TYPE_UUID:
+            return KIND_UUID;
+        case PG_TYPE_JSONB:
+            return KIND_JSONB;
+        default:
+            return KIND_TEXT;
+        }
+    }
+
+    // binary values are in network byte order
+    static uint16_t read16(const char *value) {
+        uint16_t bits;
+        memcpy(&bits, value, sizeof(bits));
+        return be16toh(bits);
+    }
+
+    static uint32_t read32(const char *value) {
+        uint32_t bits;
+        memcpy(&bits, value, sizeof(bits));
+        return be32toh(bits);
+    }
+
+    static uint64_t read64(const char *value) {
+        uint64_t bits;
+        memcpy(&bits, value, sizeof(bits));
+        return be64toh(bits);
+    }
+
+    void decodeColumn(int field) {
+        const bool binary = PQfformat(result, field) == 1;
+        const Oid type = PQftype(result, field);
+        void *data = columns[field]->Data();
+        for (int r = 0; r < rowCount; r++) {
+            const bool null = PQgetisnull(result, r, field);
+            const char *value = PQgetvalue(result, r, field);
+            const int length = PQgetlength(result, r, field);
+            switch (kinds[field]) {
+            case KIND_INT32:
+                ((int32_t *)data)[r] = null ? 0 : !binary ? (int32_t)strtol(value, nullptr, 10) : length == 2 ? (int16_t)read16(value) : (int32_t)read32(value);
+                break;
+            case KIND_INT64:
+                ((int64_t *)data)[r] = null ? 0 : !binary ? (int64_t)strtoll(value, nullptr, 10) : (int64_t)read64(value);
+                break;
+            default:
+                ((double *)data)[r] = null ? NAN : readNumber(type, binary, value, length);
+                break;
+            }
+        }
+    }
+
+    static double readNumber(Oid type, bool binary, const char *value, int length) {
+        if (!binary) {
+            // NaN and Infinity are spelled the same in postgres
+            return strtod(value, nullptr);
+        }
+        if (type == PG_TYPE_OID) {
+            return read32(value);
+        }
+        if (length == 4) {
+            uint32_t bits = read32(value);
+            float single;
+            memcpy(&single, &bits, sizeof(single));
+            return single;
+        }
+        uint64_t bits = read64(value);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        return number;
+    }
+
+    // value of a cell as the rows always had it: numbers and booleans converted, int8 as string to keep its precision, NULL as null
+    v8::Local<v8::Value> getValue(int row, int field) {
+        if (PQgetisnull(result, row, field)) {
+            return v8::Null(isolate);
+        }
+        const bool binary = PQfformat(result, field) == 1;
+        const char *value = PQgetvalue(result, row, field);
+        int length = PQgetlength(result, row, field);
+        switch (kinds[field]) {
+        case KIND_BOOL:
+            return v8::Boolean::New(isolate, binary ? value[0] != 0 : value[0] == 't');
+        case KIND_INT32:
+            return v8::Integer::New(isolate, ((int32_t *)columns[field]->Data())[row]);
+        case KIND_FLOAT64:
+            return v8::Number::New(isolate, ((double *)columns[field]->Data())[row]);
+        case KIND_INT64: {
+            char text[24];
+            length = snprintf(text, sizeof(text), "%lld", (long long)((int64_t *)columns[field]->Data())[row]);
+            return v8::String::NewFromUtf8(isolate, text, v8::NewStringType::kNormal, length).ToLocalChecked();
+        }
+        case KIND_UUID:
+            if (binary && length == 16) {
+                char text[37];
+                char *next = text;
+                for (int i = 0; i < 16; i++) {
+                    next += sprintf(next, (i == 4 || i == 6 || i == 8 || i == 10) ? "-%02x" : "%02x", (unsigned char)value[i]);
+                }
+                return v8::String::NewFromUtf8(isolate, text, v8::NewStringType::kNormal, 36).ToLocalChecked();
+            }
+            break;
+        case KIND_JSONB:
+            // the binary format is a version byte in front of the text
+            if (binary && length > 0) {
+                value++;
+                length--;
+            }
+            break;
+        default:
+            break;
+        }
+        return v8::String::NewFromUtf8(isolate, value, v8::NewStringType::kNormal, length).ToLocalChecked();
+    }
+
+    // typed array of a numeric field; undefined for the others
+    v8::Local<v8::Value> getColumn(int field) {
+        if (!columns[field]) {
+            return v8::Undefined(isolate);
+        }
+        v8::Local<v8::ArrayBuffer> buffer = v8::ArrayBuffer::New(isolate, columns[field]);
+        switch (kinds[field]) {
+        case KIND_INT32:
+            return v8::Int32Array::New(buffer, 0, rowCount);
+        case KIND_INT64:
+            return v8::BigInt64Array::New(buffer, 0, rowCount);
+        default:
+            return v8::Float64Array::New(buffer, 0, rowCount);
+        }
+    }
+
+    // index of the field of the property name; the last one wins like it did with plain row objects; -1 if there is none
+    int findField(v8::Local<v8::Name> property) {
+        char name[PG_FIELD_NAME_LIMIT];
+        v8::Local<v8::String> str = property.As<v8::String>();
+        if (str->Length() >= (int)sizeof(name)) {
+            return -1;
+        }
+        int length = str->WriteUtf8(isolate, name, sizeof(name) - 1, nullptr, v8::String::NO_NULL_TERMINATION);
+        name[length] = 0;
+        for (int f = fieldCount - 1; f >= 0; f--) {
+            if (strcmp(PQfname(result, f), name) == 0) {
+                return f;
+            }
+        }
+        return -1;
+    }
+
+    template <typename T> static PGResult *getRow(const v8::PropertyCallbackInfo<T> &info, int &row) {
+        v8::Local<v8::Value> owner = info.Holder()->GetInternalField(PG_ROW_FIELD_RESULT);
+        v8::Local<v8::Value> index = info.Holder()->GetInternalField(PG_ROW_FIELD_INDEX);
+        if (!owner->IsObject() || !index->IsInt32()) {
+            return nullptr;
+        }
+        row = index.As<v8::Int32>()->Value();
+        return (PGResult *)owner.As<v8::Object>()->GetAlignedPointerFromInternalField(PG_RESULT_FIELD_NATIVE);
+    }
+
+    static void rowGetter(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value> &info) {
+        int row;
+        PGResult *native = getRow(info, row);
+        const int field = native != nullptr ? native->findField(property) : -1;
+        if (field >= 0) {
+            info.GetReturnValue().Set(native->getValue(row, field));
+        }
+    }
+
+    static void rowQuery(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Integer> &info) {
+        int row;
+        PGResult *native = getRow(info, row);
+        if (native != nullptr && native->findField(property) >= 0) {
+            info.GetReturnValue().Set(v8::Integer::New(info.GetIsolate(), v8::ReadOnly | v8::DontDelete));
+        }
+    }
+
+    // field names in the order of the columns; the indexes are not listed, so JSON and Object.keys see the named fields only
+    static void rowEnumerator(const v8::PropertyCallbackInfo<v8::Array> &info) {
+        int row;
+        PGResult *native = getRow(info, row);
+        if (native == nullptr) {
+            return;
+        }
+        v8::Isolate *isolate = info.GetIsolate();
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        v8::Local<v8::Array> names = v8::Array::New(isolate, native->fieldCount);
+        for (int f = 0; f < native->fieldCount; f++) {
+            names->Set(context, f, v8::String::NewFromUtf8(isolate, PQfname(native->result, f), v8::NewStringType::kInternalized).ToLocalChecked()).Check();
+        }
+        info.GetReturnValue().Set(names);
+    }
+
+    static void rowIndexedGetter(uint32_t index, const v8::PropertyCallbackInfo<v8::Value> &info) {
+        int row;
+        PGResult *native = getRow(info, row);
+        if (native != nullptr && index < (uint32_t)native->fieldCount) {
+            info.GetReturnValue().Set(native->getValue(row, index));
+        }
+    }
+
+  public:
+    // holder of the native result; the result object is made from it
+    static v8::Local<v8::ObjectTemplate> createResultTemplate(v8::Isolate *isolate) {
+        v8::Local<v8::ObjectTemplate> result = v8::ObjectTemplate::New(isolate);
+        result->SetInternalFieldCount(1);
+        return result;
+    }
+
+    // rows read their cells by field name or by column index
+    static v8::Local<v8::ObjectTemplate> createRowTemplate(v8::Isolate *isolate) {
+        v8::Local<v8::ObjectTemplate> row = v8::ObjectTemplate::New(isolate);
+        row->SetInternalFieldCount(2);
+        row->SetHandler(v8::NamedPropertyHandlerConfiguration(rowGetter, nullptr, rowQuery, nullptr, rowEnumerator, v8::Local<v8::Value>(), v8::PropertyHandlerFlags::kOnlyInterceptStrings));
+        row->SetHandler(v8::IndexedPropertyHandlerConfiguration(rowIndexedGetter));
+        return row;
+    }
+
+    // {command, rowCount, fields, rows, columns} of a successful query; takes over the result
+    // columns has the typed arrays of the numeric fields by name
+    static v8::Local<v8::Object> toObject(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::ObjectTemplate> resultTemplate, v8::Local<v8::ObjectTemplate> rowTemplate, PGresult *result) {
+        v8::Local<v8::Object> object = resultTemplate->NewInstance(context).ToLocalChecked();
+        PGResult *native = new PGResult(isolate, result);
+        object->SetAlignedPointerInInternalField(PG_RESULT_FIELD_NATIVE, native);
+        native->object.Reset(isolate, object);
+        native->object.SetWeak(native, release, v8::WeakCallbackType::kParameter);
+
+        v8::Local<v8::Array> fields = v8::Array::New(isolate, native->fieldCount);
+        v8::Local<v8::Object> columns = v8::Object::New(isolate);
+        for (int f = 0; f < native->fieldCount; f++) {
+            v8::Local<v8::String> name = v8::String::NewFromUtf8(isolate, PQfname(result, f), v8::NewStringType::kInternalized).ToLocalChecked();
+            fields->Set(context, f, name).Check();
+            if (native->columns[f]) {
+                columns->Set(context, name, native->getColumn(f)).Check();
+            }
+        }
+        // every row keeps the result object and so the native result alive
+        v8::Local<v8::Array> rows = v8::Array::New(isolate, native->rowCount);
+        for (int r = 0; r < native->rowCount; r++) {
+            v8::Local<v8::Object> row = rowTemplate->NewInstance(context).ToLocalChecked();
+            row->SetInternalField(PG_ROW_FIELD_RESULT, object);
+            row->SetInternalField(PG_ROW_FIELD_INDEX, v8::Integer::New(isolate, r));
+            rows->Set(context, r, row).Check();
+        }
+        // affected rows of INSERT, UPDATE and DELETE; selected rows otherwise
+        const char *affected = PQcmdTuples(result);
+        object->Set(context, v8::String::NewFromUtf8Literal(isolate, "command"), v8::String::NewFromUtf8(isolate, PQcmdStatus(result)).ToLocalChecked()).Check();
+        object->Set(context, v8::String::NewFromUtf8Literal(isolate, "rowCount"), v8::Integer::New(isolate, *affected ? atoi(affected) : native->rowCount)).Check();
+        object->Set(context, v8::String::NewFromUtf8Literal(isolate, "fields"), fields).Check();
+        object->Set(context, v8::String::NewFromUtf8Literal(isolate, "rows"), rows).Check();
+        object->Set(context, v8::String::NewFromUtf8Literal(isolate, "columns"), columns).Check();
+        return object;
+    }
+
+    // no assignments allowed
+    PGResult &operator=(const PGResult &) = delete;
+    PGResult &operator=(PGResult &&) = delete;
+};
+
+} // namespace util
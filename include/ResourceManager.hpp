@@ -1,26 +1,419 @@
 #pragma once
 
+#include <brotli/encode.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <errno.h>
+#include <fcntl.h>
+#include <list>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
+#include <string>
+#include <string_view>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #define EXECUTE "execute"
+#define CODE_CACHE_FOLDER ".codecache"
+#define SNAPSHOT_FILE "snapshot.blob"
+#define FILE_CHECK_INTERVAL 1000
+#define FILE_CACHE_LIMIT 1024
+#define SEND_TIMEOUT 30000
+#define RESPONSE_BODY_LIMIT (256 * 1024)
+#define RESPONSE_CACHE_LIMIT (32 * 1024 * 1024)
 
 namespace util {
 
+// open descriptor of a served file with the metadata it was opened with
+// the descriptor is closed when the last user releases it
+class ResourceFile {
+  public:
+    int fd;
+    long size;
+    long long modified;
+    ino_t inode;
+    std::chrono::steady_clock::time_point checked;
+
+    ResourceFile(int _fd, long _size, long long _modified, ino_t _inode) {
+        fd = _fd;
+        size = _size;
+        modified = _modified;
+        inode = _inode;
+    }
+
+    ~ResourceFile() { close(fd); }
+
+    ResourceFile &operator=(const ResourceFile &) = delete;
+};
+
+// one encoding of a prebuilt response
+class ResourceVariant {
+  public:
+    std::string header;      // 200 status line and headers
+    std::string notModified; // complete 304 response
+    std::string body;        // whole content if the response is in memory
+    std::string etag;
+
+    bool isEmpty() const { return header.empty(); }
+};
+
+// precomputed response of a static resource for the file version it was built from
+// small files keep the body in memory so a hit is a single writev; bigger ones are sent from the file
+// compressible small files also get gzip and brotli variants; they are made off the request path and the cached
+// response is replaced by one with the variants when they are ready
+class ResourceResponse {
+  public:
+    enum Encoding { IDENTITY, GZIP, BROTLI, ENCODINGS };
+
+    std::shared_ptr<ResourceFile> file;
+    ResourceVariant variants[ENCODINGS];
+    time_t modified;
+    bool inMemory;
+
+    ResourceResponse(const std::shared_ptr<ResourceFile> &_file) : file(_file) {
+        modified = file->modified / 1000000000LL;
+        inMemory = false;
+    }
+
+    // pick the best variant the client accepts; identity if none does
+    const ResourceVariant &select(std::string_view acceptEncoding) const {
+        if (!variants[BROTLI].isEmpty() && accepts(acceptEncoding, "br")) {
+            return variants[BROTLI];
+        }
+        if (!variants[GZIP].isEmpty() && accepts(acceptEncoding, "gzip")) {
+            return variants[GZIP];
+        }
+        return variants[IDENTITY];
+    }
+
+    // true if the conditional request headers match this version; If-None-Match takes precedence
+    bool isNotModified(const ResourceVariant &variant, std::string_view ifNoneMatch, std::string_view ifModifiedSince) const {
+        if (!ifNoneMatch.empty()) {
+            return ifNoneMatch == "*" || ifNoneMatch.find(variant.etag) != std::string_view::npos;
+        }
+        if (!ifModifiedSince.empty()) {
+            struct tm tm = {};
+            std::string date(ifModifiedSince);
+            if (strptime(date.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm) != nullptr) {
+                return modified <= timegm(&tm);
+            }
+        }
+        return false;
+    }
+
+    // bytes kept in memory
+    size_t getBytes() const {
+        size_t bytes = 0;
+        for (const ResourceVariant &variant : variants) {
+            bytes += variant.body.length();
+        }
+        return bytes;
+    }
+
+    ResourceResponse &operator=(const ResourceResponse &) = delete;
+
+  private:
+    // coding listed in Accept-Encoding and not refused with q=0
+    static bool accepts(std::string_view acceptEncoding, std::string_view coding) {
+        while (!acceptEncoding.empty()) {
+            size_t comma = acceptEncoding.find(',');
+            std::string_view item = acceptEncoding.substr(0, comma);
+            acceptEncoding = comma == std::string_view::npos ? std::string_view() : acceptEncoding.substr(comma + 1);
+            while (!item.empty() && item.front() == ' ') {
+                item.remove_prefix(1);
+            }
+            size_t semicolon = item.find(';');
+            std::string_view name = item.substr(0, semicolon);
+            while (!name.empty() && name.back() == ' ') {
+                name.remove_suffix(1);
+            }
+            if (name.length() == coding.length() && strncasecmp(name.data(), coding.data(), coding.length()) == 0) {
+                if (semicolon == std::string_view::npos) {
+                    return true;
+                }
+                std::string q(item.substr(semicolon + 1));
+                const char *value = strstr(q.c_str(), "q=");
+                return value == nullptr || atof(value + 2) > 0;
+            }
+        }
+        return false;
+    }
+};
+
 class ResourceManager {
 
   private:
     std::mutex mutex;
     std::string folderName;
+    std::string codeCacheFolderName;
     const int BUFFERSIZE = 4096;
+    // "modified size name" lines of the resources read while a startup snapshot is made; guarded by mutex
+    std::string *recordedReads = nullptr;
+
+    // header of a code cache file; the cache is valid only for the exact resource version
+    struct CodeCacheHeader {
+        long long modified;
+        unsigned long long sourceLength;
+        unsigned long long dataLength;
+    };
+
+    // the resource path flattened into one file name; '%' is escaped too, so "a/b.js" and "a%b.js" get different files
+    std::string getCodeCacheName(const std::string &resourceName) {
+        std::string name;
+        name.reserve(resourceName.length() + 8);
+        for (char c : resourceName) {
+            if (c == '/') {
+                name.append("%2F");
+            } else if (c == '%') {
+                name.append("%25");
+            } else {
+                name.push_back(c);
+            }
+        }
+        return codeCacheFolderName + "/" + name + ".cache";
+    }
+
+    // open files by resource name; guarded by mutex
+    std::map<std::string, std::shared_ptr<ResourceFile>> files;
+
+    // least recently used list of prebuilt responses; bounded by count and by bytes kept in memory
+    struct CachedResponse {
+        std::shared_ptr<ResourceResponse> response;
+        std::list<std::string>::iterator order;
+    };
+    std::mutex responsesMutex;
+    std::map<std::string, CachedResponse> responses;
+    std::list<std::string> responsesOrder; // most recently used first
+    size_t responsesBytes = 0;
+
+    // cached responses waiting for their compressed variants; compressing at the best levels takes too long for a request
+    struct CompressionJob {
+        std::string name;
+        std::shared_ptr<ResourceResponse> response;
+        const char *contentType;
+    };
+    std::mutex compressionMutex;
+    std::condition_variable compressionCondition;
+    std::deque<CompressionJob> compressionJobs;
+    bool compressionStop = false;
+    std::thread compressionThread;
+
+    void eraseResponse(std::map<std::string, CachedResponse>::iterator found) {
+        responsesBytes -= found->second.response->getBytes();
+        responsesOrder.erase(found->second.order);
+        responses.erase(found);
+    }
+
+    // drop the least recently used responses over the limits; responsesMutex is held
+    void trimResponses() {
+        while (responses.size() > 1 && (responses.size() > FILE_CACHE_LIMIT || responsesBytes > RESPONSE_CACHE_LIMIT)) {
+            eraseResponse(responses.find(responsesOrder.back()));
+        }
+    }
+
+    void compressionLoop() {
+        std::unique_lock<std::mutex> lock(compressionMutex);
+        while (true) {
+            compressionCondition.wait(lock, [this] { return compressionStop || !compressionJobs.empty(); });
+            if (compressionStop) {
+                return;
+            }
+            CompressionJob job = std::move(compressionJobs.front());
+            compressionJobs.pop_front();
+            lock.unlock();
+            compressResponse(job);
+            lock.lock();
+        }
+    }
+
+    // replace the cached response with a copy that has the compressed variants; unless it was dropped or rebuilt meanwhile
+    void compressResponse(const CompressionJob &job) {
+        if (!isCached(job)) {
+            return;
+        }
+        std::shared_ptr<ResourceResponse> response = std::make_shared<ResourceResponse>(job.response->file);
+        response->inMemory = true;
+        response->variants[ResourceResponse::IDENTITY] = job.response->variants[ResourceResponse::IDENTITY];
+        const std::string &body = response->variants[ResourceResponse::IDENTITY].body;
+        char lastModified[64];
+        formatDate(response->modified, lastModified, sizeof(lastModified));
+        char etag[64];
+        ResourceVariant &gzipVariant = response->variants[ResourceResponse::GZIP];
+        if (gzip(body, gzipVariant.body) && gzipVariant.body.length() < body.length()) {
+            sprintf(etag, "\"%016llx-gz\"", hash(body));
+            buildVariant(gzipVariant, gzipVariant.body.length(), job.contentType, etag, lastModified, "gzip", true);
+        } else {
+            gzipVariant.body.clear();
+        }
+        ResourceVariant &brotliVariant = response->variants[ResourceResponse::BROTLI];
+        if (brotli(body, brotliVariant.body) && brotliVariant.body.length() < body.length()) {
+            sprintf(etag, "\"%016llx-br\"", hash(body));
+            buildVariant(brotliVariant, brotliVariant.body.length(), job.contentType, etag, lastModified, "br", true);
+        } else {
+            brotliVariant.body.clear();
+        }
+
+        std::unique_lock<std::mutex> lock(responsesMutex);
+        auto found = responses.find(job.name);
+        if (found == responses.end() || found->second.response != job.response) {
+            return;
+        }
+        responsesBytes -= found->second.response->getBytes();
+        found->second.response = response;
+        responsesBytes += response->getBytes();
+        trimResponses();
+    }
+
+    bool isCached(const CompressionJob &job) {
+        std::unique_lock<std::mutex> lock(responsesMutex);
+        auto found = responses.find(job.name);
+        return found != responses.end() && found->second.response == job.response;
+    }
+
+    static void formatDate(time_t time, char *date, size_t length) {
+        struct tm tm;
+        gmtime_r(&time, &tm);
+        strftime(date, length, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+
+    // build the response of a file version; reads the body of small files, compressed variants come later (see compressResponse)
+    std::shared_ptr<ResourceResponse> buildResponse(const std::shared_ptr<ResourceFile> &file, const char *contentType) {
+        std::shared_ptr<ResourceResponse> response = std::make_shared<ResourceResponse>(file);
+        std::string body;
+        if (file->size <= RESPONSE_BODY_LIMIT) {
+            body.resize(file->size);
+            off_t offset = 0;
+            while (offset < file->size) {
+                ssize_t bytes = pread(file->fd, &body[offset], file->size - offset, offset);
+                if (bytes < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytes <= 0) {
+                    break;
+                }
+                offset += bytes;
+            }
+            response->inMemory = offset == file->size;
+        }
+        char lastModified[64];
+        formatDate(response->modified, lastModified, sizeof(lastModified));
+
+        ResourceVariant &identity = response->variants[ResourceResponse::IDENTITY];
+        char etag[64];
+        if (response->inMemory) {
+            identity.body = std::move(body);
+            sprintf(etag, "\"%016llx\"", hash(identity.body));
+        } else {
+            sprintf(etag, "W/\"%lx-%lx-%llx\"", (unsigned long)file->inode, (unsigned long)file->size, (unsigned long long)file->modified);
+        }
+        // bodies left on disk are sent whole with sendfile
+        buildVariant(identity, response->inMemory ? identity.body.length() : file->size, contentType, etag, lastModified, nullptr, response->inMemory && isCompressible(contentType));
+        return response;
+    }
+
+    // fill status lines and headers of a variant whose body is length bytes long
+    static void buildVariant(ResourceVariant &variant, long length, const char *contentType, const char *etag, const char *lastModified, const char *encoding, bool vary) {
+        variant.etag = etag;
+        std::string extra;
+        if (encoding != nullptr) {
+            extra += "Content-Encoding: ";
+            extra += encoding;
+            extra += "\r\n";
+        }
+        if (vary) {
+            extra += "Vary: Accept-Encoding\r\n";
+        }
+        char header[1024];
+        snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-type: %s\r\nContent-Length: %ld\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n", contentType, length, etag, lastModified, extra.c_str());
+        variant.header = header;
+        snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n", etag, lastModified, vary ? "Vary: Accept-Encoding\r\n" : "");
+        variant.notModified = header;
+    }
+
+    static bool isCompressible(const char *contentType) {
+        return strncmp(contentType, "text/", 5) == 0 || strcmp(contentType, "image/svg+xml") == 0 || strcmp(contentType, "application/javascript") == 0 || strcmp(contentType, "application/json") == 0;
+    }
+
+    static bool gzip(const std::string &in, std::string &out) {
+        z_stream stream = {};
+        // 15 window bits + 16 for the gzip wrapper
+        if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return false;
+        }
+        out.resize(deflateBound(&stream, in.length()));
+        stream.next_in = (Bytef *)in.data();
+        stream.avail_in = in.length();
+        stream.next_out = (Bytef *)&out[0];
+        stream.avail_out = out.length();
+        const int result = deflate(&stream, Z_FINISH);
+        out.resize(stream.total_out);
+        deflateEnd(&stream);
+        return result == Z_STREAM_END;
+    }
+
+    static bool brotli(const std::string &in, std::string &out) {
+        size_t length = BrotliEncoderMaxCompressedSize(in.length());
+        if (length == 0) {
+            return false;
+        }
+        out.resize(length);
+        if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, in.length(), (const uint8_t *)in.data(), &length, (uint8_t *)&out[0])) {
+            return false;
+        }
+        out.resize(length);
+        return true;
+    }
+
+    // FNV-1a
+    static unsigned long long hash(const std::string &data) {
+        unsigned long long h = 14695981039346656037ULL;
+        for (unsigned char c : data) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static long long getModified(const struct stat &stat_buf) { return stat_buf.st_mtim.tv_sec * 1000000000LL + stat_buf.st_mtim.tv_nsec; }
+
+    // wait until a non blocking socket can take more data
+    static bool waitWritable(const int socket) {
+        struct pollfd pfd = {socket, POLLOUT, 0};
+        return poll(&pfd, 1, SEND_TIMEOUT) == 1 && (pfd.revents & POLLOUT);
+    }
 
   public:
-    ResourceManager(const char *folder) { folderName = folder; }
+    ResourceManager(const char *folder) {
+        folderName = folder;
+        // V8 code caches live in a sidecar folder that can't be requested (uri can't start with a dot)
+        codeCacheFolderName = folderName + "/" + CODE_CACHE_FOLDER;
+        if (mkdir(codeCacheFolderName.c_str(), 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Error: could not create folder %s: %d - %s\n", codeCacheFolderName.c_str(), errno, strerror(errno));
+        }
+        compressionThread = std::thread(&ResourceManager::compressionLoop, this);
+    }
 
-    ~ResourceManager() {}
+    ~ResourceManager() {
+        {
+            std::unique_lock<std::mutex> lock(compressionMutex);
+            compressionStop = true;
+        }
+        compressionCondition.notify_one();
+        compressionThread.join();
+    }
 
     // get size of the resource; -1 if not exist
     long getSize(const std::string &resourceName) {
@@ -30,59 +423,232 @@ class ResourceManager {
         return rc == 0 ? stat_buf.st_size : -1;
     }
 
+    // get last modification time of the resource in nanoseconds; -1 if not exist
+    long long getModified(const std::string &resourceName) {
+        std::string filename = folderName + "/" + resourceName;
+        struct stat stat_buf;
+        int rc = stat(filename.c_str(), &stat_buf);
+        return rc == 0 ? getModified(stat_buf) : -1;
+    }
+
     // get mime type
-    const char *getContentType(const std::string &resourceName) {
-        const char *name = resourceName.c_str();
-        int len = strlen(name);
+    const char *getContentType(std::string_view resourceName) {
+        int len = resourceName.length();
         int params = resourceName.find_first_of('?');
         int dot = resourceName.find_last_of('.', (params > 0) ? params : len);
         if (dot > 0) {
-            const char *extention = resourceName.c_str() + dot + 1;
-            if (strncmp(extention, "html", 4) == 0) {
+            std::string_view extention = resourceName.substr(dot + 1);
+            if (extention.substr(0, 4) == "html") {
                 return "text/html";
             }
-            if (strncmp(extention, "ico", 3) == 0) {
+            if (extention.substr(0, 3) == "ico") {
                 return "image/x-icon";
             }
-            if (strncmp(extention, "css", 3) == 0) {
+            if (extention.substr(0, 3) == "css") {
                 return "text/css";
             }
-            if (strncmp(extention, "svg", 3) == 0) {
+            if (extention.substr(0, 3) == "svg") {
                 return "image/svg+xml";
             }
-            if (strncmp(extention, "server", 5) == 0) {
+            if (extention.substr(0, 4) == "json") {
+                return "application/json";
+            }
+            if (extention.substr(0, 2) == "js") {
+                return "application/javascript";
+            }
+            if (extention.substr(0, 6) == "server") {
                 return EXECUTE;
             }
         }
         return "text/plain";
     }
 
-    // write resource to a socket
-    bool writeToSocket(const std::string &resourceName, const int socket) {
+    // get the open file of a resource from the cache; nullptr if it does not exist
+    // the path is checked again at most once per FILE_CHECK_INTERVAL so changed files are reopened
+    std::shared_ptr<ResourceFile> getFile(const std::string &resourceName) {
+        auto now = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(mutex);
+        auto found = files.find(resourceName);
+        if (found != files.end()) {
+            std::shared_ptr<ResourceFile> file = found->second;
+            if (now - file->checked < std::chrono::milliseconds(FILE_CHECK_INTERVAL)) {
+                return file;
+            }
+            std::string filename = folderName + "/" + resourceName;
+            struct stat stat_buf;
+            if (stat(filename.c_str(), &stat_buf) == 0 && stat_buf.st_ino == file->inode && stat_buf.st_size == file->size && getModified(stat_buf) == file->modified) {
+                file->checked = now;
+                return file;
+            }
+            // changed or removed; senders still holding the old one keep its descriptor until they are done
+            files.erase(found);
+        }
+
         std::string filename = folderName + "/" + resourceName;
-        FILE *file = fopen(filename.c_str(), "rb");
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat stat_buf;
+        if (fstat(fd, &stat_buf) != 0 || !S_ISREG(stat_buf.st_mode)) {
+            close(fd);
+            return nullptr;
+        }
+        std::shared_ptr<ResourceFile> file = std::make_shared<ResourceFile>(fd, stat_buf.st_size, getModified(stat_buf), stat_buf.st_ino);
+        file->checked = now;
+        if (files.size() >= FILE_CACHE_LIMIT) {
+            files.erase(files.begin());
+        }
+        files[resourceName] = file;
+        return file;
+    }
+
+    // get the prebuilt response of a resource; nullptr if it does not exist
+    // entries are rebuilt when getFile reports a different file version
+    std::shared_ptr<ResourceResponse> getResponse(const std::string &resourceName, const char *contentType) {
+        std::shared_ptr<ResourceFile> file = getFile(resourceName);
+        std::unique_lock<std::mutex> lock(responsesMutex);
+        auto found = responses.find(resourceName);
+        if (found != responses.end()) {
+            if (file && found->second.response->file == file) {
+                responsesOrder.splice(responsesOrder.begin(), responsesOrder, found->second.order);
+                return found->second.response;
+            }
+            eraseResponse(found);
+        }
         if (!file) {
-            fprintf(stderr, "Error: could not open file %s: %d - %s\n", filename.c_str(), errno, strerror(errno));
+            return nullptr;
+        }
+        lock.unlock();
+
+        std::shared_ptr<ResourceResponse> response = buildResponse(file, contentType);
+
+        lock.lock();
+        found = responses.find(resourceName);
+        if (found != responses.end()) {
+            // built meanwhile by another request
+            eraseResponse(found);
+        }
+        responsesOrder.push_front(resourceName);
+        responses[resourceName] = {response, responsesOrder.begin()};
+        responsesBytes += response->getBytes();
+        trimResponses();
+        lock.unlock();
+        if (response->inMemory && isCompressible(contentType)) {
+            std::unique_lock<std::mutex> compressionLock(compressionMutex);
+            compressionJobs.push_back({resourceName, response, contentType});
+            compressionCondition.notify_one();
+        }
+        return response;
+    }
+
+    // write a prebuilt response in the best accepted encoding; 304 if the conditional headers match, otherwise the whole content
+    bool sendResponse(const ResourceResponse &response, const int socket, std::string_view acceptEncoding, std::string_view ifNoneMatch, std::string_view ifModifiedSince) {
+        const ResourceVariant &variant = response.select(acceptEncoding);
+        if (response.isNotModified(variant, ifNoneMatch, ifModifiedSince)) {
+            return writeAll(socket, variant.notModified.data(), variant.notModified.length());
+        }
+        if (response.inMemory) {
+            struct iovec iov[2];
+            iov[0].iov_base = (void *)variant.header.data();
+            iov[0].iov_len = variant.header.length();
+            iov[1].iov_base = (void *)variant.body.data();
+            iov[1].iov_len = variant.body.length();
+            return writeAll(socket, iov, 2);
+        }
+        return writeAll(socket, variant.header.data(), variant.header.length(), MSG_MORE) && sendFile(*response.file, socket);
+    }
+
+    // write the whole file to a socket with sendfile; handles short and interrupted writes
+    bool sendFile(const ResourceFile &file, const int socket) {
+        off_t offset = 0;
+        while (offset < file.size) {
+            ssize_t bytes = sendfile(socket, file.fd, &offset, file.size - offset);
+            if (bytes > 0) {
+                continue;
+            }
+            if (bytes < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(socket)) {
+                continue;
+            }
+            // bytes == 0 means the file was truncated after it was opened
+            fprintf(stderr, "Error: could not send file to socket: %d - %s\n", errno, strerror(errno));
             return false;
         }
-        // read the resource by chunks
-        ssize_t bytes;
-        char buffer[BUFFERSIZE];
-        while ((bytes = fread(buffer, sizeof(char), BUFFERSIZE, file)) > 0) {
-            // write them to stream
-            auto bytesout = write(socket, buffer, bytes);
-            if (bytesout <= 0) {
-                fclose(file);
+        return true;
+    }
+
+    // write all buffers to a socket with one gathering call; handles short and interrupted writes
+    // MSG_MORE in flags keeps the data in the socket until the rest of the response follows
+    static bool writeAll(const int socket, struct iovec *iov, int count, int flags = 0) {
+        while (count > 0) {
+            struct msghdr message = {};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+            ssize_t bytes = sendmsg(socket, &message, flags);
+            if (bytes < 0) {
+                if (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(socket))) {
+                    continue;
+                }
                 fprintf(stderr, "Error: could not write to socket: %d - %s\n", errno, strerror(errno));
                 return false;
             }
+            // skip what is written
+            while (count > 0 && (size_t)bytes >= iov->iov_len) {
+                bytes -= iov->iov_len;
+                iov++;
+                count--;
+            }
+            if (count > 0) {
+                iov->iov_base = (char *)iov->iov_base + bytes;
+                iov->iov_len -= bytes;
+            }
         }
+        return true;
+    }
 
-        // Done and close
-        fclose(file);
+    // write the whole buffer to a socket; handles short and interrupted writes
+    // MSG_MORE in flags keeps it in the socket until the rest of the response (e.g. sendFile) follows
+    static bool writeAll(const int socket, const char *data, size_t length, int flags = 0) {
+        while (length > 0) {
+            ssize_t bytes = send(socket, data, length, flags);
+            if (bytes > 0) {
+                data += bytes;
+                length -= bytes;
+            } else if (bytes < 0 && errno == EINTR) {
+                continue;
+            } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && waitWritable(socket)) {
+                continue;
+            } else {
+                fprintf(stderr, "Error: could not write to socket: %d - %s\n", errno, strerror(errno));
+                return false;
+            }
+        }
         return true;
     }
 
+    // append the rest of an open file to a string
+    void recordRead(FILE *file, const std::string &resourceName) {
+        std::unique_lock<std::mutex> lock(mutex);
+        struct stat stat_buf;
+        if (recordedReads != nullptr && fstat(fileno(file), &stat_buf) == 0) {
+            *recordedReads += std::to_string(getModified(stat_buf)) + " " + std::to_string((long)stat_buf.st_size) + " " + resourceName + "\n";
+        }
+    }
+
+    void appendFile(FILE *file, std::string &outString) {
+        // read the resource by chunks
+        long bytes;
+        char buffer[BUFFERSIZE];
+        const char *p = buffer;
+        while ((bytes = fread((void *)buffer, sizeof(char), BUFFERSIZE, file)) > 0) {
+            // append them to str
+            outString.append(p, bytes);
+        }
+    }
+
     // get resource as string
     void asString(const std::string &resourceName, std::string &outString) {
         std::string filename = folderName + "/" + resourceName;
@@ -90,19 +656,115 @@ class ResourceManager {
         if (!file) {
             fprintf(stderr, "Error: could not open file %s: %d - %s\n", filename.c_str(), errno, strerror(errno));
         } else {
-            // read the resource by chunks
-            long bytes;
-            char buffer[BUFFERSIZE];
-            const char *p = buffer;
-            while ((bytes = fread((void *)buffer, sizeof(char), BUFFERSIZE, file)) > 0) {
-                // append them to str
-                outString.append(p, bytes);
-            }
+            appendFile(file, outString);
+            recordRead(file, resourceName);
             // Done and close.
             fclose(file);
         }
     }
 
+    // remember the version of every resource read from now on; nullptr stops
+    void recordReads(std::string *lines) {
+        std::unique_lock<std::mutex> lock(mutex);
+        recordedReads = lines;
+    }
+
+    // read the saved startup snapshot; false unless it was made with the same key and none of its resources changed since
+    bool readSnapshot(const std::string &key, std::string &outBlob) {
+        std::string filename = codeCacheFolderName + "/" + SNAPSHOT_FILE;
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+        std::string content;
+        appendFile(file, content);
+        fclose(file);
+        // the key line, the lines of the resources, an empty line and the blob
+        size_t position = 0;
+        bool header = true;
+        while (true) {
+            size_t end = content.find('\n', position);
+            if (end == std::string::npos) {
+                return false;
+            }
+            std::string line = content.substr(position, end - position);
+            position = end + 1;
+            if (header) {
+                if (line != key) {
+                    return false;
+                }
+                header = false;
+                continue;
+            }
+            if (line.empty()) {
+                break;
+            }
+            long long modified;
+            long size;
+            int name = 0;
+            if (sscanf(line.c_str(), "%lld %ld %n", &modified, &size, &name) != 2 || name == 0 || getModified(line.substr(name)) != modified || getSize(line.substr(name)) != size) {
+                return false;
+            }
+        }
+        outBlob = content.substr(position);
+        return !outBlob.empty();
+    }
+
+    // save the startup snapshot with the key and the resources it was made of (see recordReads); written aside and renamed
+    void writeSnapshot(const std::string &key, const std::string &resources, const char *data, int length) {
+        std::string filename = codeCacheFolderName + "/" + SNAPSHOT_FILE;
+        std::string tmpFilename = filename + "." + std::to_string(getpid());
+        FILE *file = fopen(tmpFilename.c_str(), "wb");
+        if (!file) {
+            fprintf(stderr, "Error: could not open file %s: %d - %s\n", tmpFilename.c_str(), errno, strerror(errno));
+            return;
+        }
+        std::string header = key + "\n" + resources + "\n";
+        bool written = fwrite(header.data(), 1, header.length(), file) == header.length() && fwrite(data, 1, length, file) == (size_t)length;
+        written = fclose(file) == 0 && written;
+        if (!written || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+            fprintf(stderr, "Error: could not write file %s: %d - %s\n", filename.c_str(), errno, strerror(errno));
+            unlink(tmpFilename.c_str());
+        }
+    }
+
+    // read the V8 code cache of a resource; false if there is none for this resource version
+    bool readCodeCache(const std::string &resourceName, long long modified, size_t sourceLength, std::string &outCache) {
+        std::string filename = getCodeCacheName(resourceName);
+        FILE *file = fopen(filename.c_str(), "rb");
+        if (!file) {
+            return false;
+        }
+        CodeCacheHeader header;
+        bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.modified == modified && header.sourceLength == sourceLength;
+        if (valid) {
+            appendFile(file, outCache);
+            valid = outCache.length() == header.dataLength;
+        }
+        fclose(file);
+        return valid;
+    }
+
+    // store the V8 code cache of a resource; written aside and renamed so readers never see a partial file
+    void writeCodeCache(const std::string &resourceName, long long modified, size_t sourceLength, const uint8_t *data, int length) {
+        std::string filename = getCodeCacheName(resourceName);
+        char suffix[64];
+        sprintf(suffix, ".%d.%lu", getpid(), (unsigned long)pthread_self());
+        std::string tmpFilename = filename + suffix;
+        FILE *file = fopen(tmpFilename.c_str(), "wb");
+        if (!file) {
+            fprintf(stderr, "Error: could not open file %s: %d - %s\n", tmpFilename.c_str(), errno, strerror(errno));
+            return;
+        }
+        CodeCacheHeader header = {modified, sourceLength, (unsigned long long)length};
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(data, 1, length, file) == (size_t)length;
+        written = fclose(file) == 0 && written;
+        if (!written || rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+            fprintf(stderr, "Error: could not write file %s: %d - %s\n", filename.c_str(), errno, strerror(errno));
+            unlink(tmpFilename.c_str());
+        }
+    }
+
     // no assignments allowed
     ResourceManager &operator=(const ResourceManager &) = delete;
     ResourceManager &operator=(ResourceManager &&) = delete;
@@ -7,7 +7,7 @@
 #include <string>
 #include <v8.h>
 
-#define SOCKET_VAR_NAME "_this_is_the_socket_variable_in_the_execution_context"
+#include "ResourceManager.hpp"
 
 static std::size_t extra_space(const char *str) noexcept {
     std::size_t result = 0;
@@ -102,23 +102,13 @@ static void escape_string(std::string &outstr, const char *str) noexcept {
 }
 
 static void serveError(int socket, const char *error) {
-    const int len = strlen(error);
-    const char *str;
-    char buff[10];
-    sprintf(buff, "%d", len);
-
-    str = "HTTP/1.1 500 ERROR\r\n";
-    write(socket, str, strlen(str));
-    str = "content-type: text/plain\r\n";
-    write(socket, str, strlen(str));
-    str = "content-length: ";
-    write(socket, str, strlen(str));
-    str = buff;
-    write(socket, str, strlen(str));
-    str = "\r\n\r\n";
-    write(socket, str, strlen(str));
-    write(socket, error, len);
-    close(socket);
+    // one write for the whole response, without waiting: the connection is closed right after, so a client that does not read gets nothing
+    std::string response("HTTP/1.1 500 ERROR\r\ncontent-type: text/plain\r\ncontent-length: ");
+    response.append(std::to_string(strlen(error)));
+    response.append("\r\n\r\n");
+    response.append(error);
+    ssize_t written = send(socket, response.data(), response.length(), MSG_DONTWAIT);
+    (void)written;
 }
 
 static void serveError(int socket, std::string &errorText) {
@@ -158,127 +148,25 @@ static void logSTDERR(const v8::FunctionCallbackInfo<v8::Value> &args) {
     }
 }
 
+// core.getBytesLength(value) - byte length of a buffer or of the UTF-8 encoding of a string, without copying
 static void getBytesLength(const v8::FunctionCallbackInfo<v8::Value> &args) {
     const auto isolate = args.GetIsolate();
     v8::HandleScope scope(isolate);
 
-    uint32_t len = 0;
-    if (args.Length() == 1) {
-        v8::String::Utf8Value value(isolate, args[0]);
-        if (*value == NULL) {
-            isolate->ThrowError("Cannot convert to char*");
-            return;
-        }
-        v8::String::Utf8Value str(isolate, args[0]);
-        len = strnlen(*str, 2 * str.length());
-        args.GetReturnValue().Set(len);
-    } else {
+    if (args.Length() != 1) {
         args.GetReturnValue().Set(0);
+        return;
     }
-}
-
-static int getSocket(v8::Isolate *isolate) {
-    int socket = -1;
-    v8::Local<v8::Context> context = isolate->GetCurrentContext();
-    auto global = context->Global();
-    auto socketMayValue = global->Get(context, v8::String::NewFromUtf8(isolate, SOCKET_VAR_NAME, v8::NewStringType::kNormal).ToLocalChecked());
-    v8::Local<v8::Value> socketValue;
-    if (socketMayValue.ToLocal(&socketValue)) {
-        if (socketValue->IsNumber()) {
-            socket = socketValue->Int32Value(isolate->GetCurrentContext()).ToChecked();
-        }
-    }
-    return socket;
-}
-
-static void socketWrite(const v8::FunctionCallbackInfo<v8::Value> &args) {
-    const auto isolate = args.GetIsolate();
-    v8::HandleScope scope(isolate);
-    const int socket = getSocket(isolate);
-    if (socket > 3) {
-        const int l = args.Length();
-        for (int i = 0; i < l; ++i) {
-            v8::Local<v8::Value> arg = args[i];
-            v8::String::Utf8Value value(isolate, arg);
-            const char *strValue = *value;
-            if (strValue == NULL) {
-                isolate->ThrowException(v8::String::NewFromUtf8(isolate, "Cannot convert parameter to char*").ToLocalChecked());
-                return;
-            }
-            write(socket, strValue, strlen(strValue));
-        }
-    } else {
-        fputs("no socket in current context !!!", stderr);
-    }
-}
-
-static void socketClose(const v8::FunctionCallbackInfo<v8::Value> &args) {
-    const auto isolate = args.GetIsolate();
-    v8::HandleScope scope(isolate);
-    const int socket = getSocket(isolate);
-    if (socket > 3) {
-        close(socket);
-        args.GetReturnValue().Set(errno);
-    } else {
-        fputs("no socket in current context !!!", stderr);
-        args.GetReturnValue().Set(-1);
-    }
-}
-
-static bool readHeader(int socket, std::string &result) {
-    std::stringstream ss;
-    int readChars = 0;
-    char twoChars[2];
-    while ((readChars = recv(socket, twoChars, 2, 0)) == 2) {
-        ss << twoChars[0];
-        ss << twoChars[1];
-        if (twoChars[0] == '\r' && twoChars[1] == '\n') {
-            // read two more to check the end of header
-            readChars = recv(socket, twoChars, 2, 0);
-            if (readChars == 2 && twoChars[0] == '\r' && twoChars[1] == '\n') {
-                // header ends  here
-                break;
-            } else {
-                continue; // reading
-            }
-        }
-        if (twoChars[0] == '\n' && twoChars[1] == '\r') {
-            // lets check if that is the end
-            readChars = recv(socket, twoChars, 1, 0);
-            if (readChars == 1 && twoChars[0] == '\n') {
-                ss << twoChars[0];
-                // header ends  here
-                break;
-            } else {
-                continue; // reading
-            }
-        }
-    }
-    if (readChars < 1) {
-        return false;
+    v8::Local<v8::Value> arg = args[0];
+    if (arg->IsArrayBufferView()) {
+        args.GetReturnValue().Set((uint32_t)arg.As<v8::ArrayBufferView>()->ByteLength());
+    } else if (arg->IsArrayBuffer()) {
+        args.GetReturnValue().Set((uint32_t)arg.As<v8::ArrayBuffer>()->ByteLength());
     } else {
-        result += ss.str();
-        return true;
-    }
-}
-
-static void socketHeader(const v8::FunctionCallbackInfo<v8::Value> &args) {
-    const auto isolate = args.GetIsolate();
-    v8::HandleScope scope(isolate);
-    const int socket = getSocket(isolate);
-
-    if (socket > 3) {
-        std::string headerString;
-        if (readHeader(socket, headerString)) {
-            v8::Local<v8::String> headerStringValue = v8::String::NewFromUtf8(isolate, headerString.c_str()).ToLocalChecked();
-            args.GetReturnValue().Set(headerStringValue);
-
-        } else {
-            isolate->ThrowError("header is not properly terminated with \\r\\n\\r\\n");
+        v8::Local<v8::String> str;
+        if (!arg->ToString(isolate->GetCurrentContext()).ToLocal(&str)) {
             return;
         }
-    } else {
-        fputs("no socket in current context !!!", stderr);
-        isolate->ThrowError("no socket in current context !!!");
+        args.GetReturnValue().Set((uint32_t)str->Utf8Length(isolate));
     }
-}
\ No newline at end of file
+}
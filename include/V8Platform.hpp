@@ -0,0 +1,143 @@
+#pragma once
+
+#define V8_COMPRESS_POINTERS
+#define V8_31BIT_SMIS_ON_64BIT_ARCH
+#include <libplatform/libplatform.h>
+#include <v8.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+
+namespace util {
+
+typedef void (*wakeup_type)(void *context);
+
+// foreground task runner of one isolate; the tasks go to the default platform queue as before
+// but the isolate thread is woken up right away, and delayed tasks are remembered so it knows when to wake up for them
+class V8TaskRunner : public v8::TaskRunner {
+  private:
+    std::shared_ptr<v8::TaskRunner> runner;
+    v8::Platform *platform;
+    wakeup_type wakeup;
+    void *wakeupContext;
+    std::mutex mutex;
+    std::multiset<double> deadlines;
+
+    void delayed(double delay_in_seconds) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            deadlines.insert(platform->MonotonicallyIncreasingTime() + delay_in_seconds);
+        }
+        wakeup(wakeupContext);
+    }
+
+  public:
+    V8TaskRunner(std::shared_ptr<v8::TaskRunner> _runner, v8::Platform *_platform, wakeup_type _wakeup, void *_wakeupContext) : runner(_runner), platform(_platform), wakeup(_wakeup), wakeupContext(_wakeupContext) {}
+
+    void PostTask(std::unique_ptr<v8::Task> task) override {
+        runner->PostTask(std::move(task));
+        wakeup(wakeupContext);
+    }
+
+    void PostNonNestableTask(std::unique_ptr<v8::Task> task) override {
+        runner->PostNonNestableTask(std::move(task));
+        wakeup(wakeupContext);
+    }
+
+    void PostDelayedTask(std::unique_ptr<v8::Task> task, double delay_in_seconds) override {
+        runner->PostDelayedTask(std::move(task), delay_in_seconds);
+        delayed(delay_in_seconds);
+    }
+
+    void PostNonNestableDelayedTask(std::unique_ptr<v8::Task> task, double delay_in_seconds) override {
+        runner->PostNonNestableDelayedTask(std::move(task), delay_in_seconds);
+        delayed(delay_in_seconds);
+    }
+
+    void PostIdleTask(std::unique_ptr<v8::IdleTask> task) override {
+        runner->PostIdleTask(std::move(task));
+        wakeup(wakeupContext);
+    }
+
+    bool IdleTasksEnabled() override { return runner->IdleTasksEnabled(); }
+    bool NonNestableTasksEnabled() const override { return runner->NonNestableTasksEnabled(); }
+    bool NonNestableDelayedTasksEnabled() const override { return runner->NonNestableDelayedTasksEnabled(); }
+
+    // milliseconds until the next delayed task is due; -1 if there is none
+    int nextDelay() {
+        std::unique_lock<std::mutex> lock(mutex);
+        const double now = platform->MonotonicallyIncreasingTime();
+        while (!deadlines.empty() && *deadlines.begin() <= now) {
+            deadlines.erase(deadlines.begin());
+        }
+        if (deadlines.empty()) {
+            return -1;
+        }
+        return (int)((*deadlines.begin() - now) * 1000) + 1;
+    }
+
+    V8TaskRunner &operator=(const V8TaskRunner &) = delete;
+};
+
+// the default platform with foreground task runners that wake up the isolate threads
+// PumpMessageLoop still has to be called with the default platform from getDefault()
+class V8Platform : public v8::Platform {
+  private:
+    std::unique_ptr<v8::Platform> platform;
+    std::mutex mutex;
+    std::map<v8::Isolate *, std::shared_ptr<V8TaskRunner>> runners;
+
+  public:
+    V8Platform(std::unique_ptr<v8::Platform> _platform) : platform(std::move(_platform)) {}
+
+    ~V8Platform() {}
+
+    v8::Platform *getDefault() { return platform.get(); }
+
+    // wakeup is called from any thread every time a task is posted for the isolate
+    std::shared_ptr<V8TaskRunner> registerIsolate(v8::Isolate *isolate, wakeup_type wakeup, void *context) {
+        std::shared_ptr<V8TaskRunner> runner = std::make_shared<V8TaskRunner>(platform->GetForegroundTaskRunner(isolate), platform.get(), wakeup, context);
+        std::unique_lock<std::mutex> lock(mutex);
+        runners[isolate] = runner;
+        return runner;
+    }
+
+    void unregisterIsolate(v8::Isolate *isolate) {
+        std::unique_lock<std::mutex> lock(mutex);
+        runners.erase(isolate);
+    }
+
+    std::shared_ptr<v8::TaskRunner> GetForegroundTaskRunner(v8::Isolate *isolate) override {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto found = runners.find(isolate);
+            if (found != runners.end()) {
+                return found->second;
+            }
+        }
+        return platform->GetForegroundTaskRunner(isolate);
+    }
+
+    v8::PageAllocator *GetPageAllocator() override { return platform->GetPageAllocator(); }
+    void OnCriticalMemoryPressure() override { platform->OnCriticalMemoryPressure(); }
+    bool OnCriticalMemoryPressure(size_t length) override { return platform->OnCriticalMemoryPressure(length); }
+    int NumberOfWorkerThreads() override { return platform->NumberOfWorkerThreads(); }
+    void CallOnWorkerThread(std::unique_ptr<v8::Task> task) override { platform->CallOnWorkerThread(std::move(task)); }
+    void CallBlockingTaskOnWorkerThread(std::unique_ptr<v8::Task> task) override { platform->CallBlockingTaskOnWorkerThread(std::move(task)); }
+    void CallLowPriorityTaskOnWorkerThread(std::unique_ptr<v8::Task> task) override { platform->CallLowPriorityTaskOnWorkerThread(std::move(task)); }
+    void CallDelayedOnWorkerThread(std::unique_ptr<v8::Task> task, double delay_in_seconds) override { platform->CallDelayedOnWorkerThread(std::move(task), delay_in_seconds); }
+    bool IdleTasksEnabled(v8::Isolate *isolate) override { return platform->IdleTasksEnabled(isolate); }
+    std::unique_ptr<v8::JobHandle> PostJob(v8::TaskPriority priority, std::unique_ptr<v8::JobTask> job_task) override { return platform->PostJob(priority, std::move(job_task)); }
+    double MonotonicallyIncreasingTime() override { return platform->MonotonicallyIncreasingTime(); }
+    double CurrentClockTimeMillis() override { return platform->CurrentClockTimeMillis(); }
+    StackTracePrinter GetStackTracePrinter() override { return platform->GetStackTracePrinter(); }
+    v8::TracingController *GetTracingController() override { return platform->GetTracingController(); }
+
+    // no assignments allowed
+    V8Platform &operator=(const V8Platform &) = delete;
+    V8Platform &operator=(V8Platform &&) = delete;
+};
+
+} // namespace util
@@ -6,16 +6,35 @@
 #include <libplatform/libplatform.h>
 #include <v8.h>
 
+#include <atomic>
 #include <map>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <thread>
-
-#include "ArrayBlockingQueue.hpp"
+#include <unordered_map>
+#include <vector>
+
+#include "HTTPMultiThreadServer.hpp"
+#include "HTTPResponse.hpp"
+#include "MPMCQueue.hpp"
+#include "PGPool.hpp"
+#include "PGResult.hpp"
 #include "ResourceManager.hpp"
+#include "V8Platform.hpp"
 
 #define PUMP_LIMIT 5
+#define ISOLATE_SLOT_THREAD 0
+#define ISOLATE_SLOT_RESOURCES 1
+#define SNAPSHOT_REQUEST_FUNCTION 0
+#define MODULE_CHECK_INTERVAL 1000
+#define MODULE_DEPTH_LIMIT 16
 #define GLOBAL_JS "__global__.js"
+#define BODY_READ_CHUNK (64 * 1024)
+#define HEADERS_FIELD_NATIVE 0
+#define REQUEST_FIELD_SOCKET 0
+#define SQL_STATEMENT_LIMIT 4096
 
 #define DEBUG_MODE
 
@@ -37,14 +56,29 @@ class V8Task {
     std::string module;
     std::string method;
     std::string uri;
+    util::HTTPURL url;
+    util::HTTPHeaders headers;
     int socket;
+    // whole body, or for a streamed body the part of it received with the head
+    std::string body;
+    bool bodyStreamed;
+    util::HTTPBodyDecoder bodyDecoder;
 
-    V8Task(int _socket, const std::string &_module, const std::string &_method, const std::string &_uri) {
+    V8Task(const std::string &_module, util::HTTPRequest *httpRequest) {
         module = _module;
-        method = _method;
-        uri = _uri;
-        socket = _socket;
+        method = httpRequest->method;
+        uri = httpRequest->uri;
+        url = httpRequest->url;
+        headers.assign(httpRequest->header, httpRequest->headers);
+        socket = httpRequest->socket;
         request = true;
+        bodyStreamed = httpRequest->bodyStreamed;
+        if (bodyStreamed) {
+            body = std::move(httpRequest->bodyRest);
+            bodyDecoder = httpRequest->bodyDecoder;
+        } else {
+            body.assign(httpRequest->body);
+        }
     }
 
     ~V8Task() {}
@@ -54,180 +88,1123 @@ class V8Task {
 
 class V8Thread {
   private:
-    static std::map<void *, V8Thread *> isolateToThread;
-    static V8Thread *getByIsolate(void *isolate) { return V8Thread::isolateToThread[isolate]; }
+    // the owning thread is kept in the isolate data slot so callbacks can find it without locking
+    static V8Thread *getByIsolate(v8::Isolate *isolate) { return (V8Thread *)isolate->GetData(ISOLATE_SLOT_THREAD); }
+    // resources are reachable also while the startup snapshot is created, where there is no thread
+    static util::ResourceManager *getResourceManager(v8::Isolate *isolate) { return (util::ResourceManager *)isolate->GetData(ISOLATE_SLOT_RESOURCES); }
 
     util::ResourceManager *resourceManager;
+    util::HTTPMultiThreadServer *httpServer;
+    util::V8Platform *platform;
+    v8::StartupData *snapshot;
 
     const char *arg;
     bool exit;
+    // requests queued or still executing in this isolate; used by the pool for scheduling
+    std::atomic<int> load;
+    // compiled modules of this isolate by resource name; only touched from the event loop thread
+    struct CachedModule {
+        v8::Global<v8::Module> module;
+        long long modified;
+        std::chrono::steady_clock::time_point checked;
+        std::vector<std::string> imports;
+    };
+    std::map<std::string, CachedModule> moduleCache;
+    // resource names of the cached modules by identity hash; hashes are not unique, the module itself tells them apart
+    std::multimap<int, std::string> moduleNames;
+    // responses being built by the handlers by socket; only touched from the event loop thread
+    std::map<int, util::HTTPResponse> responses;
+    // body memory kept between responses so encoding a string does not allocate each time
+    std::string responseScratch;
+    // handlers waiting for a streamed response to be taken by the socket, by socket
+    std::map<int, v8::Global<v8::Promise::Resolver>> drainWaiters;
+    // completed responses the socket has not taken yet, by socket; the connection is released once they are drained
+    // the value tells whether it is closed then
+    std::map<int, bool> closing;
+    // streamed request bodies by socket; decoded when the handler reads them
+    struct RequestBody {
+        util::HTTPBodyDecoder decoder;
+        std::string received; // not decoded yet; once the body is done it is what follows the body
+    };
+    std::map<int, RequestBody> requestBodies;
+    // handlers waiting for request body bytes, by socket
+    std::map<int, v8::Global<v8::Promise::Resolver>> readWaiters;
+    enum ReadResult { READ_DATA, READ_END, READ_WAIT, READ_FAILED };
+    // request headers by socket; the JS object reads them through interceptors until the request completes
+    struct RequestHeaders {
+        util::HTTPHeaders headers;
+        v8::Global<v8::Object> object;
+    };
+    std::map<int, RequestHeaders> requestHeaders;
+    v8::Global<v8::ObjectTemplate> headersTemplate;
+    // native requests carry their socket in an internal field, so concurrent handlers each write to their own connection
+    v8::Global<v8::FunctionTemplate> requestClass;
+    // property names of the request objects; internalized once, the template declares them in this order
+    enum RequestKey { KEY_SOCKET, KEY_METHOD, KEY_URI, KEY_PATH, KEY_MODULE, KEY_QUERY, KEY_HEADERS, KEY_BODY, KEY_BODY_STREAMED, KEY_COUNT };
+    v8::Eternal<v8::String> requestKeys[KEY_COUNT];
+    util::MPMCQueue<V8Task> eventLoopQueue;
     std::thread eventLoopThread;
-    util::ArrayBlockingQueue<V8Task> eventLoopQueue;
+    // the loop sleeps in epoll on the wakeup eventfd and on the sockets handlers wait for
+    // new tasks and posted platform tasks bump wakeups and signal the eventfd only when the loop sleeps
+    int epoll;
+    int wakeupFd;
+    std::atomic<bool> sleeping;
+    std::atomic<unsigned int> wakeups;
+    std::shared_ptr<util::V8TaskRunner> taskRunner;
+    // events registered in the epoll by socket
+    std::map<int, uint32_t> watched;
+    // database connections of the isolate and the queries waiting for their results by id
+    util::PGPool database;
+    std::map<uint64_t, v8::Global<v8::Promise::Resolver>> databaseQueries;
+    uint64_t databaseQueryId;
+    // statement ids of the SQL run prepared; the frozen templates of the SQL syntax are found by identity without reading
+    // their text again, plain [sql, ...params] arrays by their text; ids are never reused, so forgetting them is safe
+    struct SQLTemplate {
+        v8::Global<v8::Array> object;
+        std::string sql;
+        uint32_t statement;
+        uint32_t placeholders;
+    };
+    std::unordered_multimap<int, SQLTemplate> sqlTemplates; // by identity hash
+    std::unordered_map<std::string, uint32_t> sqlTexts;
+    uint32_t sqlStatementId;
+    // query results and their rows read the cells lazily from the native result (see PGResult)
+    v8::Global<v8::ObjectTemplate> resultTemplate;
+    v8::Global<v8::ObjectTemplate> rowTemplate;
 
     void eventLoopThreadHandler() {
         exit = true;
-        // Creating platform
-        std::unique_ptr<v8::Platform> platform = v8::platform::NewDefaultPlatform(2, v8::platform::IdleTaskSupport::kEnabled);
-        // Initializing V8 VM
-        v8::V8::InitializePlatform(platform.get());
-        v8::V8::Initialize();
-        // Creating isolate from the params (VM instance)
+        // Creating isolate from the params (VM instance); from the startup snapshot when there is one
         v8::Isolate::CreateParams create_params;
         create_params.array_buffer_allocator = v8::ArrayBuffer::Allocator::NewDefaultAllocator();
+        if (snapshot != nullptr) {
+            create_params.snapshot_blob = snapshot;
+            create_params.external_references = externalReferences();
+        }
         v8::Isolate *isolate = v8::Isolate::New(create_params);
-        // add to map
-        isolateToThread[(void *)isolate] = this;
+        taskRunner = platform->registerIsolate(isolate, wakeup, this);
+        isolate->SetData(ISOLATE_SLOT_THREAD, this);
+        isolate->SetData(ISOLATE_SLOT_RESOURCES, resourceManager);
 
         {
             v8::Isolate::Scope isolate_scope(isolate);
             // any Local should has this one first
             v8::HandleScope handle_scope(isolate);
+            setupIsolate(isolate);
+
+            v8::Local<v8::Context> context_;
+            v8::Local<v8::Function> requestFunction_;
+            if (snapshot != nullptr) {
+                // core, global and the evaluated __global__.js come with the default context
+                context_ = v8::Context::New(isolate);
+                context_->AllowCodeGenerationFromStrings(false);
+                context_->GetDataFromSnapshotOnce<v8::Function>(SNAPSHOT_REQUEST_FUNCTION).ToLocal(&requestFunction_);
+            } else {
+                context_ = bootstrapContext(isolate, requestFunction_);
+            }
+            v8::Context::Scope context_scope(context_);
+            exit = requestFunction_.IsEmpty();
+            headersTemplate.Reset(isolate, createHeadersTemplate(isolate));
+            requestClass.Reset(isolate, createRequestClass(isolate, requestKeys));
+            resultTemplate.Reset(isolate, util::PGResult::createResultTemplate(isolate));
+            rowTemplate.Reset(isolate, util::PGResult::createRowTemplate(isolate));
+
+            while (!exit) {
+                const unsigned int seen = wakeups.load();
+                // platform tasks and the promises they resolve
+                bool busy = false;
+                for (int count = 0; v8::platform::PumpMessageLoop(platform->getDefault(), isolate); count++) {
+                    if (count >= PUMP_LIMIT) {
+                        busy = true;
+                        break;
+                    }
+                }
+                isolate->PerformMicrotaskCheckpoint();
+
+                // new requests; the loop comes back to the platform tasks in between
+                for (int count = 0; count < PUMP_LIMIT; count++) {
+                    V8Task *task = eventLoopQueue.dequeue_nowait();
+                    if (task == nullptr) {
+                        break;
+                    }
+                    runTask(isolate, context_, requestFunction_, task);
+                    isolate->PerformMicrotaskCheckpoint();
+                    busy = true;
+                }
+                // the queries of this round go out together
+                database.dispatch();
+                if (!busy) {
+                    waitForEvents(isolate, seen);
+                }
+            }
+            headersTemplate.Reset();
+            requestClass.Reset();
+            sqlTemplates.clear();
+            resultTemplate.Reset();
+            rowTemplate.Reset();
+            databaseQueries.clear();
+        }
+
+        // Proper VM deconstructing; V8 itself is disposed by the pool
+        platform->unregisterIsolate(isolate);
+        isolate->Dispose();
+        delete create_params.array_buffer_allocator;
+    }
 
-            isolate->SetCaptureStackTraceForUncaughtExceptions(true, 1000, v8::StackTrace::kDetailed);
-            // Binding dynamic import() callbacks
-            isolate->SetHostImportModuleDynamicallyCallback(callDynamic);
-            isolate->SetPromiseRejectCallback(PromiseRejectCallback);
-            isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+  public:
+    // V8 must already be initialized with the given platform (see V8ThreadPool)
+    // the isolate starts from the snapshot if one is given, otherwise it bootstraps __global__.js itself
+    // database is the libpq connection string of the isolate's postgres connections, databasePool how many it may open
+    V8Thread(const char *_argv0, util::ResourceManager *_resourceManager, util::HTTPMultiThreadServer *_httpServer, util::V8Platform *_platform, v8::StartupData *_snapshot, const std::string &_database, int _databasePool)
+        : resourceManager(_resourceManager), httpServer(_httpServer), platform(_platform), snapshot(_snapshot), exit(false), load(0), eventLoopQueue(256), epoll(epoll_create1(EPOLL_CLOEXEC)), sleeping(false), wakeups(0),
+          database(_database, _databasePool, epoll, databaseResult, this), databaseQueryId(0), sqlStatementId(0) {
+        arg = _argv0;
+        wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = wakeupFd;
+        if (epoll < 0 || wakeupFd < 0 || epoll_ctl(epoll, EPOLL_CTL_ADD, wakeupFd, &event) < 0) {
+            fprintf(stderr, "Error: V8Thread wakeup not created: %d - %s\n", errno, strerror(errno));
+        }
+        eventLoopThread = std::thread(&V8Thread::eventLoopThreadHandler, this);
+        eventLoopThread.detach();
+    }
 
-            v8::Local<v8::ObjectTemplate> global_ = v8::ObjectTemplate::New(isolate);
-            global_->Set(isolate, "include", v8::FunctionTemplate::New(isolate, include));
+    ~V8Thread() {
+        exit = true;
+        // eventLoopThread.join();
+    }
+
+    // bootstrap a context once and serialize it with __global__.js (and what it includes) evaluated
+    // the returned blob is owned by the caller (delete[] data); data is null if bootstrapping failed
+    static v8::StartupData createSnapshot(util::ResourceManager *resourceManager) {
+        v8::SnapshotCreator creator(externalReferences());
+        v8::Isolate *isolate = creator.GetIsolate();
+        isolate->SetData(ISOLATE_SLOT_THREAD, nullptr);
+        isolate->SetData(ISOLATE_SLOT_RESOURCES, resourceManager);
+        bool ready = false;
+        {
+            v8::HandleScope handle_scope(isolate);
+            setupIsolate(isolate);
+            v8::Local<v8::Function> requestFunction;
+            v8::Local<v8::Context> context = bootstrapContext(isolate, requestFunction);
             {
-                // Binding functions
-                v8::Local<v8::ObjectTemplate> core = v8::ObjectTemplate::New(isolate);
+                v8::Context::Scope context_scope(context);
+                isolate->PerformMicrotaskCheckpoint();
+            }
+            creator.SetDefaultContext(context);
+            if (!requestFunction.IsEmpty()) {
+                ready = creator.AddData(context, requestFunction) == SNAPSHOT_REQUEST_FUNCTION;
+            }
+        }
+        // the blob has to be created in any case before the creator goes away
+        v8::StartupData blob = creator.CreateBlob(v8::SnapshotCreator::FunctionCodeHandling::kKeep);
+        if (!ready) {
+            delete[] blob.data;
+            blob.data = nullptr;
+            blob.raw_size = 0;
+        }
+        return blob;
+    }
 
-                core->Set(isolate, "logSTDOUT", v8::FunctionTemplate::New(isolate, logSTDOUT));
-                core->Set(isolate, "logSTDERR", v8::FunctionTemplate::New(isolate, logSTDERR));
+    void enqueueTask(V8Task *task) {
+        load++;
+        eventLoopQueue.enqueue(task);
+        wakeup(this);
+    }
 
-                core->Set(isolate, "socketWrite", v8::FunctionTemplate::New(isolate, socketWrite));
-                core->Set(isolate, "socketClose", v8::FunctionTemplate::New(isolate, socketClose));
-                core->Set(isolate, "socketHeader", v8::FunctionTemplate::New(isolate, socketHeader));
-                core->Set(isolate, "getBytesLength", v8::FunctionTemplate::New(isolate, getBytesLength));
+    // called from any thread when there is work for the loop
+    static void wakeup(void *context) {
+        V8Thread *thread = (V8Thread *)context;
+        thread->wakeups.fetch_add(1);
+        if (thread->sleeping.load()) {
+            uint64_t one = 1;
+            ssize_t written = write(thread->wakeupFd, &one, sizeof(one));
+            (void)written;
+        }
+    }
+
+    int getLoad() { return load.load(std::memory_order_relaxed); }
 
-                global_->Set(v8::String::NewFromUtf8Literal(isolate, "core", v8::NewStringType::kNormal), core);
+  private:
+    // call the __global__.js request function with the request object of the task
+    void runTask(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Function> requestFunction, V8Task *task) {
+        try {
+            v8::HandleScope handle_scope(isolate);
+            v8::TryCatch try_catch(isolate);
+            v8::Local<v8::Object> requestObject;
+            if (!requestClass.Get(isolate)->InstanceTemplate()->NewInstance(context).ToLocal(&requestObject)) {
+                throw std::runtime_error("cannot create request object");
+            }
+            requestObject->SetInternalField(REQUEST_FIELD_SOCKET, v8::Int32::New(isolate, task->socket));
+
+            // the fields exist already, so these are stores into the object and no new properties
+            setField(isolate, context, requestObject, KEY_SOCKET, v8::Int32::New(isolate, task->socket));
+            setField(isolate, context, requestObject, KEY_METHOD, v8::String::NewFromUtf8(isolate, task->method.data(), v8::NewStringType::kInternalized, task->method.length()).ToLocalChecked());
+            setField(isolate, context, requestObject, KEY_URI, v8::String::NewFromUtf8(isolate, task->uri.data(), v8::NewStringType::kNormal, task->uri.length()).ToLocalChecked());
+            setField(isolate, context, requestObject, KEY_PATH, v8::String::NewFromUtf8(isolate, task->url.getPath().data(), v8::NewStringType::kNormal, task->url.getPath().length()).ToLocalChecked());
+            // the handler module checked by the server; the script must not derive another one from the path
+            setField(isolate, context, requestObject, KEY_MODULE, v8::String::NewFromUtf8(isolate, task->module.data(), v8::NewStringType::kNormal, task->module.length()).ToLocalChecked());
+            setField(isolate, context, requestObject, KEY_QUERY, createQuery(isolate, context, task->url));
+            setField(isolate, context, requestObject, KEY_HEADERS, createHeaders(isolate, context, task));
+            // small bodies come whole with the request, bigger ones are read with core.requestRead()
+            if (task->bodyStreamed) {
+                RequestBody &requestBody = requestBodies[task->socket];
+                requestBody.decoder = task->bodyDecoder;
+                requestBody.received = std::move(task->body);
+                setField(isolate, context, requestObject, KEY_BODY_STREAMED, v8::True(isolate));
+            } else if (!task->body.empty()) {
+                setField(isolate, context, requestObject, KEY_BODY, toArrayBuffer(isolate, std::move(task->body)));
             }
 
-            // Creating context
-            v8::Local<v8::Context> context_ = v8::Context::New(isolate, NULL, global_);
-            v8::Context::Scope context_scope(context_);
-            context_->AllowCodeGenerationFromStrings(false);
-            v8::Local<v8::Object> globalInstance = context_->Global();
-            globalInstance->Set(context_, v8::String::NewFromUtf8Literal(isolate, "global", v8::NewStringType::kNormal), globalInstance).Check();
-            v8::Local<v8::Value> obj = globalInstance->Get(context_, v8::String::NewFromUtf8Literal(isolate, "core", v8::NewStringType::kNormal)).ToLocalChecked();
-            v8::Local<v8::Object> coreInstance = v8::Local<v8::Object>::Cast(obj);
-            coreInstance->Set(context_, v8::String::NewFromUtf8Literal(isolate, "global", v8::NewStringType::kNormal), globalInstance).Check();
+            const int argc = 1;
+            v8::Local<v8::Value> argv[argc] = {requestObject};
+            v8::MaybeLocal<v8::Value> callResult = requestFunction->Call(context, context->Global(), argc, argv);
+
+            // log classical try cach error
+            // async ones are served by PromiseRejectCallback
+            if (try_catch.HasCaught()) {
+                v8::String::Utf8Value exception(isolate, try_catch.Exception());
+                v8::Local<v8::Message> message = try_catch.Message();
+                std::string exeptionText = getExceptionString(isolate, exception, message);
+                fputs(exeptionText.c_str(), stderr);
+                requestObject->SetInternalField(REQUEST_FIELD_SOCKET, v8::Int32::New(isolate, -1));
+                responses.erase(task->socket);
+                requestBodies.erase(task->socket);
+                forgetRequest(isolate, task->socket);
+                serveError(task->socket, exeptionText);
+                load--;
+                httpServer->releaseConnection(task->socket, true);
+            }
 
-            v8::Local<v8::Function> requestFunction_;
+        } catch (...) {
+            // nothing to do here
+            fprintf(stderr, "V8Thread Exception\n");
+        }
+        delete task;
+    }
 
-            { // compile and load global js
-                v8::TryCatch try_catch(isolate);
-                std::string name(GLOBAL_JS);
-                std::string source;
-                resourceManager->asString(name, source);
-                v8::Local<v8::String> nameLocal = v8::String::NewFromUtf8(isolate, name.c_str()).ToLocalChecked();
-                v8::Local<v8::String> sourceLocal = v8::String::NewFromUtf8(isolate, source.c_str()).ToLocalChecked();
-
-                v8::ScriptOrigin origin(nameLocal,                    // source name
-                                        v8::Integer::New(isolate, 0), // line offset
-                                        v8::Integer::New(isolate, 0), // column offset
-                                        v8::False(isolate),           // cross origin
-                                        v8::Local<v8::Integer>(),     // script id
-                                        v8::Local<v8::Value>(),       // source map url
-                                        v8::False(isolate),           // is opaque
-                                        v8::False(isolate),           // is WASM
-                                        v8::False(isolate)            // is ES6 module
-                );
-
-                auto compileResult = v8::Script::Compile(context_, sourceLocal, &origin);
-                v8::Local<v8::Script> script;
-                if (compileResult.ToLocal(&script)) {
-                    v8::Local<v8::Value> result;
-                    auto runResult = script->Run(context_);
-                    if (runResult.ToLocal(&result)) {
-                        if (result->IsFunction()) {
-                            requestFunction_ = result.As<v8::Function>();
-                            exit = false;
-                        } else {
-                            fputs("global result is not a function", stderr);
-                        }
+    // sleep until there is a task, a platform task is posted or due, or a socket a handler waits for is ready
+    // nothing was missed if the wakeups did not change since the loop started its round
+    void waitForEvents(v8::Isolate *isolate, unsigned int seen) {
+        struct epoll_event events[EPOLL_EVENTS];
+        int n = 0;
+        sleeping.store(true);
+        if (wakeups.load() == seen) {
+            int timeout = taskRunner->nextDelay();
+            const int databaseTimeout = database.nextTimeout();
+            if (timeout < 0 || (databaseTimeout >= 0 && databaseTimeout < timeout)) {
+                timeout = databaseTimeout;
+            }
+            n = epoll_wait(epoll, events, EPOLL_EVENTS, timeout);
+        }
+        sleeping.store(false);
+        v8::HandleScope scope(isolate);
+        database.maintain();
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == wakeupFd) {
+                uint64_t value;
+                ssize_t bytes = read(wakeupFd, &value, sizeof(value));
+                (void)bytes;
+                continue;
+            }
+            if (database.process(fd)) {
+                continue;
+            }
+            if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && drainWaiters.count(fd) > 0) {
+                serveDrain(isolate, fd);
+            }
+            if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && closing.count(fd) > 0) {
+                serveClose(fd);
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && readWaiters.count(fd) > 0) {
+                serveRead(isolate, fd);
+            }
+        }
+    }
+
+    // keep the socket in the epoll for as long as handlers wait for it or its response is not drained
+    void watchSocket(int socket) {
+        const uint32_t events = (drainWaiters.count(socket) > 0 || closing.count(socket) > 0 ? (uint32_t)EPOLLOUT : 0) | (readWaiters.count(socket) > 0 ? (uint32_t)EPOLLIN : 0);
+        auto found = watched.find(socket);
+        if (events == 0) {
+            if (found != watched.end()) {
+                epoll_ctl(epoll, EPOLL_CTL_DEL, socket, nullptr);
+                watched.erase(found);
+            }
+            return;
+        }
+        struct epoll_event event;
+        event.events = events;
+        event.data.fd = socket;
+        if (found == watched.end()) {
+            epoll_ctl(epoll, EPOLL_CTL_ADD, socket, &event);
+            watched[socket] = events;
+        } else if (found->second != events) {
+            epoll_ctl(epoll, EPOLL_CTL_MOD, socket, &event);
+            found->second = events;
+        }
+    }
+
+    // native callbacks have to be listed for the snapshot serializer; null terminated
+    static const intptr_t *externalReferences() {
+        static const intptr_t references[] = {
+            reinterpret_cast<intptr_t>(include),
+            reinterpret_cast<intptr_t>(logSTDOUT),
+            reinterpret_cast<intptr_t>(logSTDERR),
+            reinterpret_cast<intptr_t>(responseStatus),
+            reinterpret_cast<intptr_t>(responseHeader),
+            reinterpret_cast<intptr_t>(responseStream),
+            reinterpret_cast<intptr_t>(responseDrain),
+            reinterpret_cast<intptr_t>(socketWrite),
+            reinterpret_cast<intptr_t>(requestRead),
+            reinterpret_cast<intptr_t>(socketClose),
+            reinterpret_cast<intptr_t>(getBytesLength),
+            reinterpret_cast<intptr_t>(databaseQuery),
+            reinterpret_cast<intptr_t>(databaseStats),
+            0,
+        };
+        return references;
+    }
+
+    // query parameters as a plain object; the last of repeated names wins
+    static v8::Local<v8::Object> createQuery(v8::Isolate *isolate, v8::Local<v8::Context> context, util::HTTPURL &url) {
+        v8::Local<v8::Object> query = v8::Object::New(isolate);
+        for (size_t i = 0; i < url.size(); i++) {
+            std::string_view name = url.name(i);
+            std::string_view value = url.value(i);
+            v8::Local<v8::String> nameLocal = v8::String::NewFromUtf8(isolate, name.data(), v8::NewStringType::kNormal, name.length()).ToLocalChecked();
+            v8::Local<v8::String> valueLocal = v8::String::NewFromUtf8(isolate, value.data(), v8::NewStringType::kNormal, value.length()).ToLocalChecked();
+            query->CreateDataProperty(context, nameLocal, valueLocal).Check();
+        }
+        return query;
+    }
+
+    // headers object of a request; the native headers move to the thread so they live as long as the request
+    v8::Local<v8::Value> createHeaders(v8::Isolate *isolate, v8::Local<v8::Context> context, V8Task *task) {
+        v8::Local<v8::Object> object;
+        if (!headersTemplate.Get(isolate)->NewInstance(context).ToLocal(&object)) {
+            return v8::Null(isolate);
+        }
+        RequestHeaders &request = requestHeaders[task->socket];
+        request.headers.swap(task->headers);
+        request.object.Reset(isolate, object);
+        object->SetAlignedPointerInInternalField(HEADERS_FIELD_NATIVE, &request.headers);
+        return object;
+    }
+
+    // drop what is kept for a completed request; its headers object is cut from the native headers
+    void forgetRequest(v8::Isolate *isolate, int socket) {
+        drainWaiters.erase(socket);
+        readWaiters.erase(socket);
+        watchSocket(socket);
+        auto found = requestHeaders.find(socket);
+        if (found != requestHeaders.end()) {
+            v8::HandleScope scope(isolate);
+            found->second.object.Get(isolate)->SetAlignedPointerInInternalField(HEADERS_FIELD_NATIVE, nullptr);
+            requestHeaders.erase(found);
+        }
+    }
+
+    // class of the native request objects; only its instances are accepted by the core response and body functions
+    // all fields are declared with their defaults, so every request starts with the same final shape
+    static v8::Local<v8::FunctionTemplate> createRequestClass(v8::Isolate *isolate, v8::Eternal<v8::String> *keys) {
+        static const char *names[KEY_COUNT] = {"socket", "method", "uri", "path", "module", "query", "headers", "body", "bodyStreamed"};
+        v8::Local<v8::FunctionTemplate> request = v8::FunctionTemplate::New(isolate);
+        request->SetClassName(v8::String::NewFromUtf8Literal(isolate, "NativeRequest"));
+        v8::Local<v8::ObjectTemplate> instance = request->InstanceTemplate();
+        instance->SetInternalFieldCount(1);
+        for (int i = 0; i < KEY_COUNT; i++) {
+            v8::Local<v8::String> key = v8::String::NewFromUtf8(isolate, names[i], v8::NewStringType::kInternalized).ToLocalChecked();
+            keys[i].Set(isolate, key);
+            v8::Local<v8::Primitive> value = v8::Null(isolate);
+            if (i == KEY_BODY_STREAMED) {
+                value = v8::False(isolate);
+            }
+            instance->Set(key, value);
+        }
+        return request;
+    }
+
+    bool setField(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Object> object, RequestKey key, v8::Local<v8::Value> value) { return object->Set(context, requestKeys[key].Get(isolate), value).FromMaybe(false); }
+
+    // socket of the native request given as the first argument; -1 if it is no request or it is already completed
+    static int getRequestSocket(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        v8::Isolate *isolate = args.GetIsolate();
+        V8Thread *thread = getByIsolate(isolate);
+        if (args.Length() < 1 || thread == nullptr || !thread->requestClass.Get(isolate)->HasInstance(args[0])) {
+            return -1;
+        }
+        v8::Local<v8::Value> socket = args[0].As<v8::Object>()->GetInternalField(REQUEST_FIELD_SOCKET);
+        return socket->IsInt32() ? socket.As<v8::Int32>()->Value() : -1;
+    }
+
+    // headers are looked up natively by case insensitive name; nothing is created in JS until a header is read
+    static v8::Local<v8::ObjectTemplate> createHeadersTemplate(v8::Isolate *isolate) {
+        v8::Local<v8::ObjectTemplate> headers = v8::ObjectTemplate::New(isolate);
+        headers->SetInternalFieldCount(1);
+        headers->SetHandler(v8::NamedPropertyHandlerConfiguration(headerGetter, nullptr, headerQuery, nullptr, headerEnumerator, v8::Local<v8::Value>(), v8::PropertyHandlerFlags::kOnlyInterceptStrings));
+        return headers;
+    }
+
+    template <typename T> static util::HTTPHeaders *getHeaders(const v8::PropertyCallbackInfo<T> &info) { return (util::HTTPHeaders *)info.Holder()->GetAlignedPointerFromInternalField(HEADERS_FIELD_NATIVE); }
+
+    static bool findHeader(v8::Isolate *isolate, util::HTTPHeaders *headers, v8::Local<v8::Name> property, std::string_view &value) {
+        if (headers == nullptr) {
+            return false;
+        }
+        char name[256];
+        v8::Local<v8::String> str = property.As<v8::String>();
+        if (str->Length() >= (int)sizeof(name)) {
+            return false;
+        }
+        int length = str->WriteUtf8(isolate, name, sizeof(name), nullptr, v8::String::NO_NULL_TERMINATION);
+        return headers->get(std::string_view(name, length), value);
+    }
+
+    static void headerGetter(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value> &info) {
+        std::string_view value;
+        if (findHeader(info.GetIsolate(), getHeaders(info), property, value)) {
+            info.GetReturnValue().Set(v8::String::NewFromUtf8(info.GetIsolate(), value.data(), v8::NewStringType::kNormal, value.length()).ToLocalChecked());
+        }
+    }
+
+    static void headerQuery(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Integer> &info) {
+        std::string_view value;
+        if (findHeader(info.GetIsolate(), getHeaders(info), property, value)) {
+            info.GetReturnValue().Set(v8::Integer::New(info.GetIsolate(), v8::ReadOnly | v8::DontDelete));
+        }
+    }
+
+    // header names in lower case as they are looked up; repeated headers are listed once
+    static void headerEnumerator(const v8::PropertyCallbackInfo<v8::Array> &info) {
+        v8::Isolate *isolate = info.GetIsolate();
+        util::HTTPHeaders *headers = getHeaders(info);
+        if (headers == nullptr) {
+            info.GetReturnValue().Set(v8::Array::New(isolate));
+            return;
+        }
+        std::vector<v8::Local<v8::Value>> names;
+        names.reserve(headers->size());
+        std::string name;
+        for (size_t i = 0; i < headers->size(); i++) {
+            std::string_view first;
+            if (headers->get(headers->name(i), first) && first.data() != headers->value(i).data()) {
+                continue;
+            }
+            name.assign(headers->name(i));
+            for (char &c : name) {
+                c = tolower(c);
+            }
+            names.push_back(v8::String::NewFromUtf8(isolate, name.data(), v8::NewStringType::kNormal, name.length()).ToLocalChecked());
+        }
+        info.GetReturnValue().Set(v8::Array::New(isolate, names.data(), names.size()));
+    }
+
+    void serveDrain(v8::Isolate *isolate, int socket) {
+        auto found = responses.find(socket);
+        bool ok = found != responses.end() && found->second.sendPending(socket);
+        if (ok && !found->second.isWritable()) {
+            return;
+        }
+        auto waiter = drainWaiters.find(socket);
+        v8::Local<v8::Promise::Resolver> resolver = waiter->second.Get(isolate);
+        drainWaiters.erase(waiter);
+        watchSocket(socket);
+        if (ok) {
+            resolver->Resolve(isolate->GetCurrentContext(), v8::True(isolate)).Check();
+        } else {
+            resolver->Reject(isolate->GetCurrentContext(), v8::Exception::Error(v8::String::NewFromUtf8Literal(isolate, "connection is closed"))).Check();
+        }
+    }
+
+    // the rest of a completed response went out, or the connection failed; the socket leaves the epoll before it is released
+    void serveClose(int socket) {
+        auto found = responses.find(socket);
+        if (found != responses.end() && found->second.sendPending(socket) && !found->second.isDrained()) {
+            return;
+        }
+        bool forceClose = closing[socket];
+        if (found != responses.end()) {
+            forceClose = found->second.isFailed() || forceClose;
+            found->second.recycle(responseScratch);
+            responses.erase(found);
+        }
+        closing.erase(socket);
+        watchSocket(socket);
+        httpServer->releaseConnection(socket, forceClose);
+    }
+
+    void serveRead(v8::Isolate *isolate, int socket) {
+        auto found = requestBodies.find(socket);
+        std::string bytes;
+        ReadResult result = found == requestBodies.end() ? READ_END : readBody(socket, found->second, bytes);
+        if (result == READ_WAIT) {
+            return;
+        }
+        auto waiter = readWaiters.find(socket);
+        v8::Local<v8::Promise::Resolver> resolver = waiter->second.Get(isolate);
+        readWaiters.erase(waiter);
+        watchSocket(socket);
+        settleRead(isolate, resolver, result, std::move(bytes));
+    }
+
+    // decode what is received and receive more without blocking until there are body bytes
+    static ReadResult readBody(int socket, RequestBody &body, std::string &bytes) {
+        while (!body.decoder.isDone()) {
+            if (!body.received.empty()) {
+                size_t consumed = 0;
+                util::HTTPParser::Result result = body.decoder.decode(body.received.data(), body.received.length(), consumed, bytes);
+                body.received.erase(0, consumed);
+                if (result == util::HTTPParser::INVALID || result == util::HTTPParser::TOO_LARGE) {
+                    fprintf(stderr, "Error: request body: %s\n", body.decoder.getError());
+                    return READ_FAILED;
+                }
+                if (!bytes.empty()) {
+                    return READ_DATA;
+                }
+                continue;
+            }
+            body.received.resize(BODY_READ_CHUNK);
+            ssize_t count = recv(socket, &body.received[0], BODY_READ_CHUNK, MSG_DONTWAIT);
+            body.received.resize(count > 0 ? count : 0);
+            if (count > 0 || (count < 0 && errno == EINTR)) {
+                continue;
+            } else if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return READ_WAIT;
+            }
+            return READ_FAILED;
+        }
+        return bytes.empty() ? READ_END : READ_DATA;
+    }
+
+    static void settleRead(v8::Isolate *isolate, v8::Local<v8::Promise::Resolver> resolver, ReadResult result, std::string &&bytes) {
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        if (result == READ_DATA) {
+            resolver->Resolve(context, toArrayBuffer(isolate, std::move(bytes))).Check();
+        } else if (result == READ_END) {
+            resolver->Resolve(context, v8::Null(isolate)).Check();
+        } else {
+            resolver->Reject(context, v8::Exception::Error(v8::String::NewFromUtf8Literal(isolate, "request body could not be read"))).Check();
+        }
+    }
+
+    // ArrayBuffer over the bytes of a string; the string is kept alive by the backing store instead of copied
+    static v8::Local<v8::ArrayBuffer> toArrayBuffer(v8::Isolate *isolate, std::string &&bytes) {
+        std::string *owned = new std::string(std::move(bytes));
+        std::unique_ptr<v8::BackingStore> store = v8::ArrayBuffer::NewBackingStore(
+            &(*owned)[0], owned->length(), [](void *, size_t, void *owner) { delete (std::string *)owner; }, owned);
+        return v8::ArrayBuffer::New(isolate, std::move(store));
+    }
+
+    // isolate wide settings; these are not part of the snapshot
+    static void setupIsolate(v8::Isolate *isolate) {
+        isolate->SetCaptureStackTraceForUncaughtExceptions(true, 1000, v8::StackTrace::kDetailed);
+        // Binding dynamic import() callbacks
+        isolate->SetHostImportModuleDynamicallyCallback(callDynamic);
+        isolate->SetPromiseRejectCallback(PromiseRejectCallback);
+        isolate->SetMicrotasksPolicy(v8::MicrotasksPolicy::kExplicit);
+    }
+
+    // create the context with the core bindings and run __global__.js in it
+    // requestFunction is left empty if __global__.js does not result in a function
+    static v8::Local<v8::Context> bootstrapContext(v8::Isolate *isolate, v8::Local<v8::Function> &requestFunction) {
+        v8::Local<v8::ObjectTemplate> global_ = v8::ObjectTemplate::New(isolate);
+        global_->Set(isolate, "include", v8::FunctionTemplate::New(isolate, include));
+        {
+            // Binding functions
+            v8::Local<v8::ObjectTemplate> core = v8::ObjectTemplate::New(isolate);
+
+            core->Set(isolate, "logSTDOUT", v8::FunctionTemplate::New(isolate, logSTDOUT));
+            core->Set(isolate, "logSTDERR", v8::FunctionTemplate::New(isolate, logSTDERR));
+
+            core->Set(isolate, "responseStatus", v8::FunctionTemplate::New(isolate, responseStatus));
+            core->Set(isolate, "responseHeader", v8::FunctionTemplate::New(isolate, responseHeader));
+            core->Set(isolate, "responseStream", v8::FunctionTemplate::New(isolate, responseStream));
+            core->Set(isolate, "responseDrain", v8::FunctionTemplate::New(isolate, responseDrain));
+            core->Set(isolate, "socketWrite", v8::FunctionTemplate::New(isolate, socketWrite));
+            core->Set(isolate, "requestRead", v8::FunctionTemplate::New(isolate, requestRead));
+            core->Set(isolate, "socketClose", v8::FunctionTemplate::New(isolate, socketClose));
+            core->Set(isolate, "getBytesLength", v8::FunctionTemplate::New(isolate, getBytesLength));
+
+            v8::Local<v8::ObjectTemplate> pg = v8::ObjectTemplate::New(isolate);
+            pg->Set(isolate, "query", v8::FunctionTemplate::New(isolate, databaseQuery));
+            pg->Set(isolate, "stats", v8::FunctionTemplate::New(isolate, databaseStats));
+            core->Set(isolate, "pg", pg);
+
+            global_->Set(v8::String::NewFromUtf8Literal(isolate, "core", v8::NewStringType::kNormal), core);
+        }
+
+        // Creating context
+        v8::Local<v8::Context> context_ = v8::Context::New(isolate, NULL, global_);
+        v8::Context::Scope context_scope(context_);
+        context_->AllowCodeGenerationFromStrings(false);
+        v8::Local<v8::Object> globalInstance = context_->Global();
+        globalInstance->Set(context_, v8::String::NewFromUtf8Literal(isolate, "global", v8::NewStringType::kNormal), globalInstance).Check();
+        v8::Local<v8::Value> obj = globalInstance->Get(context_, v8::String::NewFromUtf8Literal(isolate, "core", v8::NewStringType::kNormal)).ToLocalChecked();
+        v8::Local<v8::Object> coreInstance = v8::Local<v8::Object>::Cast(obj);
+        coreInstance->Set(context_, v8::String::NewFromUtf8Literal(isolate, "global", v8::NewStringType::kNormal), globalInstance).Check();
+
+        { // compile and load global js
+            v8::TryCatch try_catch(isolate);
+            std::string name(GLOBAL_JS);
+            std::string source;
+            getResourceManager(isolate)->asString(name, source);
+            v8::Local<v8::String> nameLocal = v8::String::NewFromUtf8(isolate, name.c_str()).ToLocalChecked();
+            v8::Local<v8::String> sourceLocal = v8::String::NewFromUtf8(isolate, source.c_str()).ToLocalChecked();
+
+            v8::ScriptOrigin origin(nameLocal,                    // source name
+                                    v8::Integer::New(isolate, 0), // line offset
+                                    v8::Integer::New(isolate, 0), // column offset
+                                    v8::False(isolate),           // cross origin
+                                    v8::Local<v8::Integer>(),     // script id
+                                    v8::Local<v8::Value>(),       // source map url
+                                    v8::False(isolate),           // is opaque
+                                    v8::False(isolate),           // is WASM
+                                    v8::False(isolate)            // is ES6 module
+            );
+
+            auto compileResult = v8::Script::Compile(context_, sourceLocal, &origin);
+            v8::Local<v8::Script> script;
+            if (compileResult.ToLocal(&script)) {
+                v8::Local<v8::Value> result;
+                auto runResult = script->Run(context_);
+                if (runResult.ToLocal(&result)) {
+                    if (result->IsFunction()) {
+                        requestFunction = result.As<v8::Function>();
                     } else {
-                        fputs("global result is not defined", stderr);
+                        fputs("global result is not a function", stderr);
                     }
                 } else {
-                    // there should be exception
+                    fputs("global result is not defined", stderr);
                 }
+            } else {
+                // there should be exception
+            }
+
+            ReportException(isolate, try_catch);
+        }
+        return context_;
+    }
+
+    // response of the native request given as the first argument; created with the first call
+    static util::HTTPResponse *getResponse(const v8::FunctionCallbackInfo<v8::Value> &args, int &socket) {
+        v8::Isolate *isolate = args.GetIsolate();
+        socket = getRequestSocket(args);
+        if (socket <= 3) {
+            isolate->ThrowError("no request or the request is already completed");
+            return nullptr;
+        }
+        V8Thread *thread = getByIsolate(isolate);
+        auto found = thread->responses.find(socket);
+        if (found != thread->responses.end()) {
+            return &found->second;
+        }
+        util::HTTPResponse *response = &thread->responses[socket];
+        response->adopt(thread->responseScratch);
+        return response;
+    }
 
-                ReportException(isolate, try_catch);
+    // core.responseStatus(request, status, [reason]) - start the response; drops what is collected and not sent yet
+    static void responseStatus(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        int socket;
+        util::HTTPResponse *response = getResponse(args, socket);
+        if (response == nullptr || args.Length() < 2) {
+            return;
+        }
+        const int status = args[1]->Int32Value(isolate->GetCurrentContext()).FromMaybe(500);
+        std::string reason = (status == 200) ? "OK" : "ERROR";
+        if (args.Length() > 2) {
+            v8::String::Utf8Value value(isolate, args[2]);
+            if (*value != NULL) {
+                reason.assign(*value, value.length());
             }
+        }
+        if (!util::HTTPResponse::isValidText(reason)) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "invalid reason phrase")));
+            return;
+        }
+        if (!response->setStatus(status, reason)) {
+            isolate->ThrowError("response is already sent");
+        }
+    }
 
-            while (!exit) {
-                // pump message loop and resolve promises
-                for (int count = 0; v8::platform::PumpMessageLoop(platform.get(), isolate) && count < PUMP_LIMIT; count++) {
-                    continue;
+    // core.responseHeader(request, name, value) - TypeError for a name that is no token or a value with CR, LF or NUL
+    static void responseHeader(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        int socket;
+        util::HTTPResponse *response = getResponse(args, socket);
+        if (response == nullptr || args.Length() < 3) {
+            return;
+        }
+        v8::String::Utf8Value name(isolate, args[1]);
+        v8::String::Utf8Value value(isolate, args[2]);
+        if (*name == NULL || *value == NULL) {
+            isolate->ThrowError("Cannot convert parameter to char*");
+            return;
+        }
+        if (!util::HTTPResponse::isValidHeader(std::string_view(*name, name.length()), std::string_view(*value, value.length()))) {
+            isolate->ThrowException(v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "invalid header name or value")));
+            return;
+        }
+        if (!response->addHeader(std::string_view(*name, name.length()), std::string_view(*value, value.length()))) {
+            isolate->ThrowError("response is not started or already sent");
+        }
+    }
+
+    // core.responseStream(request) - send the head now and every following socketWrite as a chunk
+    static void responseStream(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        int socket;
+        util::HTTPResponse *response = getResponse(args, socket);
+        if (response == nullptr) {
+            return;
+        }
+        if (!response->stream(socket) && !response->isFailed()) {
+            isolate->ThrowError("response is not started or already sent");
+        }
+    }
+
+    // core.responseDrain(request) - promise resolved when a streamed response can take more writes
+    static void responseDrain(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        v8::Local<v8::Promise::Resolver> resolver;
+        if (!v8::Promise::Resolver::New(context).ToLocal(&resolver)) {
+            return;
+        }
+        args.GetReturnValue().Set(resolver->GetPromise());
+        int socket = getRequestSocket(args);
+        util::HTTPResponse *response = socket > 3 ? getResponse(args, socket) : nullptr;
+        if (response == nullptr || response->isFailed()) {
+            resolver->Reject(context, v8::Exception::Error(v8::String::NewFromUtf8Literal(isolate, "connection is closed"))).Check();
+        } else if (response->isWritable()) {
+            resolver->Resolve(context, v8::True(isolate)).Check();
+        } else {
+            V8Thread *thread = getByIsolate(isolate);
+            thread->drainWaiters[socket].Reset(isolate, resolver);
+            thread->watchSocket(socket);
+        }
+    }
+
+    // core.socketWrite(request, ...values) - append to the response body; returns false when a streamed response should wait for drain
+    // ArrayBuffer and views are written from their backing store; strings are encoded straight into the buffer
+    static void socketWrite(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        int socket;
+        util::HTTPResponse *response = getResponse(args, socket);
+        if (response == nullptr) {
+            return;
+        }
+        const int l = args.Length();
+        for (int i = 1; i < l; ++i) {
+            v8::Local<v8::Value> arg = args[i];
+            if (arg->IsArrayBufferView()) {
+                v8::Local<v8::ArrayBufferView> view = arg.As<v8::ArrayBufferView>();
+                const char *data = (const char *)view->Buffer()->GetBackingStore()->Data();
+                response->write(socket, data + view->ByteOffset(), view->ByteLength());
+            } else if (arg->IsArrayBuffer()) {
+                std::shared_ptr<v8::BackingStore> store = arg.As<v8::ArrayBuffer>()->GetBackingStore();
+                response->write(socket, (const char *)store->Data(), store->ByteLength());
+            } else {
+                v8::Local<v8::String> str;
+                if (!arg->ToString(isolate->GetCurrentContext()).ToLocal(&str)) {
+                    return;
                 }
-                isolate->PerformMicrotaskCheckpoint();
+                const size_t length = str->Utf8Length(isolate);
+                char *buffer = response->reserve(length);
+                const size_t written = str->WriteUtf8(isolate, buffer, length, nullptr, v8::String::NO_NULL_TERMINATION | v8::String::REPLACE_INVALID_UTF8);
+                response->shrink(length - written);
+                response->flushIfFull(socket);
+            }
+        }
+        if (response->isStreaming()) {
+            response->flush(socket, false);
+        }
+        args.GetReturnValue().Set(response->isWritable());
+    }
 
-                V8Task *task = eventLoopQueue.dequeue_for(std::chrono::milliseconds(1000));
-                if (task) {
-                    try {
-                        // Enter this processor's context so all the remaining operations be executed in it
-                        v8::Local<v8::Context> context = v8::Local<v8::Context>::New(isolate, context_);
-                        v8::Context::Scope context_scope(context);
-                        v8::Local<v8::Object> global = context->Global();
-                        v8::TryCatch try_catch(isolate);
-                        v8::Local<v8::Object> requestObject = v8::Object::New(isolate);
-
-                        auto t = global->Set(context, v8::String::NewFromUtf8(isolate, SOCKET_VAR_NAME, v8::NewStringType::kNormal).ToLocalChecked(), v8::Int32::New(isolate, task->socket));
-                        t = requestObject->Set(context, v8::String::NewFromUtf8(isolate, "socket", v8::NewStringType::kNormal).ToLocalChecked(), v8::Int32::New(isolate, task->socket));
-                        t = requestObject->Set(context, v8::String::NewFromUtf8(isolate, "method", v8::NewStringType::kNormal).ToLocalChecked(), v8::String::NewFromUtf8(isolate, task->method.c_str(), v8::NewStringType::kNormal).ToLocalChecked());
-                        t = requestObject->Set(context, v8::String::NewFromUtf8(isolate, "uri", v8::NewStringType::kNormal).ToLocalChecked(), v8::String::NewFromUtf8(isolate, task->uri.c_str(), v8::NewStringType::kNormal).ToLocalChecked());
-
-                        const int argc = 1;
-                        v8::Local<v8::Value> argv[argc] = {requestObject};
-                        v8::Local<v8::Function> requestFunction = v8::Local<v8::Function>::New(isolate, requestFunction_);
-                        v8::MaybeLocal<v8::Value> callResult = requestFunction->Call(context, context->Global(), argc, argv);
-
-                        // log classical try cach error
-                        // async ones are served by PromiseRejectCallback
-                        if (try_catch.HasCaught()) {
-                            v8::String::Utf8Value exception(isolate, try_catch.Exception());
-                            v8::Local<v8::Message> message = try_catch.Message();
-                            std::string exeptionText = getExceptionString(isolate, exception, message);
-                            fputs(exeptionText.c_str(), stderr);
-                            serveError(task->socket, exeptionText);
-                        }
-
-                    } catch (...) {
-                        // nothing to do here
-                        fprintf(stderr, "V8Thread Exception\n");
-                    }
-                    delete task;
+    // core.requestRead(request) - promise of the next ArrayBuffer of a streamed request body; null at its end
+    static void requestRead(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Promise::Resolver> resolver;
+        if (!v8::Promise::Resolver::New(isolate->GetCurrentContext()).ToLocal(&resolver)) {
+            return;
+        }
+        args.GetReturnValue().Set(resolver->GetPromise());
+        const int socket = getRequestSocket(args);
+        V8Thread *thread = getByIsolate(isolate);
+        auto found = thread->requestBodies.find(socket);
+        if (socket <= 3 || found == thread->requestBodies.end()) {
+            settleRead(isolate, resolver, READ_END, std::string());
+            return;
+        }
+        if (thread->readWaiters.count(socket) > 0) {
+            resolver->Reject(isolate->GetCurrentContext(), v8::Exception::Error(v8::String::NewFromUtf8Literal(isolate, "request body is already being read"))).Check();
+            return;
+        }
+        std::string bytes;
+        ReadResult result = readBody(socket, found->second, bytes);
+        if (result == READ_WAIT) {
+            thread->readWaiters[socket].Reset(isolate, resolver);
+            thread->watchSocket(socket);
+        } else {
+            settleRead(isolate, resolver, result, std::move(bytes));
+        }
+    }
+
+    // core.socketClose(request, [forceClose]) - response is done; send it and hand the connection back to the server for keep-alive
+    static void socketClose(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        const int socket = getRequestSocket(args);
+        if (socket > 3) {
+            bool forceClose = args.Length() > 1 && args[1]->BooleanValue(isolate);
+            // the request object may outlive the request; its socket can belong to another connection by then
+            args[0].As<v8::Object>()->SetInternalField(REQUEST_FIELD_SOCKET, v8::Int32::New(isolate, -1));
+            V8Thread *thread = getByIsolate(isolate);
+            // the connection can be kept only when the body was read to the end; what follows it is the next request
+            auto body = thread->requestBodies.find(socket);
+            if (body != thread->requestBodies.end()) {
+                if (body->second.decoder.isDone()) {
+                    thread->httpServer->bodyRead(socket, std::move(body->second.received));
                 }
+                thread->requestBodies.erase(body);
             }
+            auto found = thread->responses.find(socket);
+            if (found != thread->responses.end()) {
+                forceClose = !found->second.flush(socket, true) || forceClose;
+                if (!found->second.isDrained()) {
+                    // a slow reader must not hold up the isolate; the event loop writes the rest and releases the connection
+                    thread->closing[socket] = forceClose;
+                    thread->forgetRequest(isolate, socket);
+                    thread->load--;
+                    args.GetReturnValue().Set(0);
+                    return;
+                }
+                found->second.recycle(thread->responseScratch);
+                thread->responses.erase(found);
+            }
+            thread->forgetRequest(isolate, socket);
+            thread->load--;
+            thread->httpServer->releaseConnection(socket, forceClose);
+            args.GetReturnValue().Set(0);
+        } else {
+            fputs("no request or the request is already completed\n", stderr);
+            args.GetReturnValue().Set(-1);
         }
+    }
 
-        // clean up
-        isolateToThread.erase((void *)isolate);
+    // core.pg.query(sql) - promise of {command, rowCount, fields, rows}; rejected with the postgres error
+    // sql is a string or [sql, ...params] as made by the SQL syntax: null and undefined are NULL, objects go as JSON
+    static void databaseQuery(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        v8::Local<v8::Promise::Resolver> resolver;
+        if (!v8::Promise::Resolver::New(context).ToLocal(&resolver)) {
+            return;
+        }
+        args.GetReturnValue().Set(resolver->GetPromise());
+        V8Thread *thread = getByIsolate(isolate);
+        util::PGQuery query;
+        bool valid;
+        {
+            // parameters are converted with their toString() and toJSON(), which may throw
+            v8::TryCatch try_catch(isolate);
+            valid = thread != nullptr && args.Length() > 0 && thread->toQuery(isolate, context, args[0], query);
+            if (try_catch.HasCaught()) {
+                resolver->Reject(context, try_catch.Exception()).Check();
+                return;
+            }
+        }
+        if (!valid) {
+            resolver->Reject(context, v8::Exception::TypeError(v8::String::NewFromUtf8Literal(isolate, "expecting SQL string, [sql, ...params] array or SQL syntax"))).Check();
+            return;
+        }
+        const uint64_t id = ++thread->databaseQueryId;
+        thread->databaseQueries[id].Reset(isolate, resolver);
+        query.tag = (void *)(uintptr_t)id;
+        if (!thread->database.query(std::move(query))) {
+            thread->databaseQueries.erase(id);
+            resolver->Reject(context, v8::Exception::Error(v8::String::NewFromUtf8Literal(isolate, "too many queries waiting for the database"))).Check();
+        }
+    }
 
-        // Proper VM deconstructing
-        isolate->Dispose();
-        v8::V8::Dispose();
-        v8::V8::ShutdownPlatform();
+    // core.pg.stats() - connection pool of this isolate: {size, open, inUse, waiting, queries, rejected, waitTime}
+    // waitTime is the histogram of the time queries waited for a connection: {bounds: [ms], counts: []}, the last bucket has no bound
+    static void databaseStats(const v8::FunctionCallbackInfo<v8::Value> &args) {
+        const auto isolate = args.GetIsolate();
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Context> context = isolate->GetCurrentContext();
+        V8Thread *thread = getByIsolate(isolate);
+        if (thread == nullptr) {
+            return;
+        }
+        util::PGPool &pool = thread->database;
+        v8::Local<v8::Array> bounds = v8::Array::New(isolate, PG_POOL_BUCKETS - 1);
+        v8::Local<v8::Array> counts = v8::Array::New(isolate, PG_POOL_BUCKETS);
+        for (int i = 0; i < PG_POOL_BUCKETS; i++) {
+            if (i < PG_POOL_BUCKETS - 1) {
+                bounds->Set(context, i, v8::Number::New(isolate, util::PGPool::getWaitBound(i) / 1000.0)).Check();
+            }
+            counts->Set(context, i, v8::Number::New(isolate, (double)pool.getWaitCount(i))).Check();
+        }
+        v8::Local<v8::Object> waitTime = v8::Object::New(isolate);
+        waitTime->Set(context, v8::String::NewFromUtf8Literal(isolate, "bounds"), bounds).Check();
+        waitTime->Set(context, v8::String::NewFromUtf8Literal(isolate, "counts"), counts).Check();
+        v8::Local<v8::Object> stats = v8::Object::New(isolate);
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "size"), v8::Number::New(isolate, (double)pool.getSize())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "open"), v8::Number::New(isolate, (double)pool.getOpen())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "inUse"), v8::Number::New(isolate, (double)pool.getInUse())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "waiting"), v8::Number::New(isolate, (double)pool.getWaiting())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "queries"), v8::Number::New(isolate, (double)pool.getQueries())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "rejected"), v8::Number::New(isolate, (double)pool.getRejected())).Check();
+        stats->Set(context, v8::String::NewFromUtf8Literal(isolate, "waitTime"), waitTime).Check();
+        args.GetReturnValue().Set(stats);
     }
 
-  public:
-    V8Thread(const char *_argv0, util::ResourceManager *_resourceManager) : exit(false), resourceManager(_resourceManager), eventLoopQueue(256), eventLoopThread(&V8Thread::eventLoopThreadHandler, this) {
-        arg = _argv0;
-        eventLoopThread.detach();
+    // statement of a plain SQL text
+    uint32_t textStatement(const std::string &sql) {
+        auto found = sqlTexts.find(sql);
+        if (found != sqlTexts.end()) {
+            return found->second;
+        }
+        if (sqlTexts.size() >= SQL_STATEMENT_LIMIT) {
+            sqlTexts.clear();
+        }
+        return sqlTexts[sql] = ++sqlStatementId;
     }
 
-    ~V8Thread() {
-        exit = true;
-        // eventLoopThread.join();
+    // the SQL syntax gives the same frozen template [sql] with raw [kinds] on every call of a site, one kind per placeholder
+    // ('s' for a string constant, 'v' for an expression); null if it is not such a template
+    SQLTemplate *findTemplate(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Array> object) {
+        const int hash = object->GetIdentityHash();
+        auto range = sqlTemplates.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.object.Get(isolate) == object) {
+                return &it->second;
+            }
+        }
+        v8::Local<v8::Value> text;
+        v8::Local<v8::Value> raw;
+        v8::Local<v8::Value> kinds;
+        if (!object->Get(context, 0).ToLocal(&text) || !text->IsString() || !object->Get(context, v8::String::NewFromUtf8Literal(isolate, "raw")).ToLocal(&raw) || !raw->IsArray() ||
+            !raw.As<v8::Array>()->Get(context, 0).ToLocal(&kinds) || !kinds->IsString()) {
+            return nullptr;
+        }
+        if (sqlTemplates.size() >= SQL_STATEMENT_LIMIT) {
+            sqlTemplates.clear();
+        }
+        SQLTemplate &found = sqlTemplates.emplace(hash, SQLTemplate())->second;
+        found.object.Reset(isolate, object);
+        found.sql = *v8::String::Utf8Value(isolate, text);
+        found.statement = ++sqlStatementId;
+        found.placeholders = kinds.As<v8::String>()->Length();
+        return &found;
     }
 
-    void enqueueTask(V8Task *task) { eventLoopQueue.enqueue(task); }
+    bool toQuery(v8::Isolate *isolate, v8::Local<v8::Context> context, v8::Local<v8::Value> sql, util::PGQuery &query) {
+        if (sql->IsString()) {
+            query.sql = *v8::String::Utf8Value(isolate, sql);
+            return true;
+        }
+        if (!sql->IsArray()) {
+            return false;
+        }
+        v8::Local<v8::Array> array = sql.As<v8::Array>();
+        v8::Local<v8::Value> head;
+        if (array->Length() < 1 || !array->Get(context, 0).ToLocal(&head)) {
+            return false;
+        }
+        // the text of an SQL literal is the same on every call, so it is worth a prepared statement
+        if (head->IsString()) {
+            query.sql = *v8::String::Utf8Value(isolate, head);
+            query.statement = textStatement(query.sql);
+        } else if (head->IsArray()) {
+            SQLTemplate *found = findTemplate(isolate, context, head.As<v8::Array>());
+            if (found == nullptr || found->placeholders != array->Length() - 1) {
+                return false;
+            }
+            query.sql = found->sql;
+            query.statement = found->statement;
+        } else {
+            return false;
+        }
+        query.values.reserve(array->Length() - 1);
+        for (uint32_t i = 1; i < array->Length(); i++) {
+            v8::Local<v8::Value> param;
+            if (!array->Get(context, i).ToLocal(&param)) {
+                return false;
+            }
+            if (param->IsNullOrUndefined()) {
+                query.values.emplace_back();
+                query.nulls.push_back(true);
+                continue;
+            }
+            v8::Local<v8::String> str;
+            if (param->IsDate()) {
+                // postgres does not read the toString() format of dates
+                v8::Local<v8::Value> toISOString;
+                v8::Local<v8::Value> iso;
+                if (!param.As<v8::Object>()->Get(context, v8::String::NewFromUtf8Literal(isolate, "toISOString")).ToLocal(&toISOString) || !toISOString->IsFunction() ||
+                    !toISOString.As<v8::Function>()->Call(context, param, 0, nullptr).ToLocal(&iso) || !iso->ToString(context).ToLocal(&str)) {
+                    return false;
+                }
+            } else if (param->IsObject()) {
+                if (!v8::JSON::Stringify(context, param).ToLocal(&str)) {
+                    return false;
+                }
+            } else if (!param->ToString(context).ToLocal(&str)) {
+                return false;
+            }
+            query.values.emplace_back(*v8::String::Utf8Value(isolate, str));
+            query.nulls.push_back(false);
+        }
+        return true;
+    }
+
+    // called by the database connection from the event loop with the result of a query
+    static void databaseResult(void *context, void *tag, PGresult *result, const char *error) {
+        V8Thread *thread = (V8Thread *)context;
+        v8::Isolate *isolate = v8::Isolate::GetCurrent();
+        auto found = thread->databaseQueries.find((uint64_t)(uintptr_t)tag);
+        if (isolate == nullptr || found == thread->databaseQueries.end()) {
+            PQclear(result);
+            return;
+        }
+        v8::HandleScope scope(isolate);
+        v8::Local<v8::Context> v8Context = isolate->GetCurrentContext();
+        v8::Local<v8::Promise::Resolver> resolver = found->second.Get(isolate);
+        thread->databaseQueries.erase(found);
+        if (result == nullptr) {
+            resolver->Reject(v8Context, v8::Exception::Error(v8::String::NewFromUtf8(isolate, error).ToLocalChecked())).Check();
+            return;
+        }
+        const ExecStatusType status = PQresultStatus(result);
+        if (status == PGRES_COMMAND_OK || status == PGRES_TUPLES_OK || status == PGRES_EMPTY_QUERY) {
+            // the result object owns the native result from here on
+            resolver->Resolve(v8Context, util::PGResult::toObject(isolate, v8Context, thread->resultTemplate.Get(isolate), thread->rowTemplate.Get(isolate), result)).Check();
+            return;
+        }
+        // the message of the error and its SQLSTATE as code
+        v8::Local<v8::Value> exception = v8::Exception::Error(v8::String::NewFromUtf8(isolate, PQresultErrorMessage(result)).ToLocalChecked());
+        const char *code = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+        if (code != nullptr) {
+            exception.As<v8::Object>()->Set(v8Context, v8::String::NewFromUtf8Literal(isolate, "code"), v8::String::NewFromUtf8(isolate, code).ToLocalChecked()).Check();
+        }
+        resolver->Reject(v8Context, exception).Check();
+        PQclear(result);
+    }
 
-  private:
     static void include(const v8::FunctionCallbackInfo<v8::Value> &args) {
         if (args.Length() < 1) {
             return;
@@ -238,49 +1215,28 @@ class V8Thread {
         // Enter this processor's context so all the remaining operations be executed in it
         v8::Local<v8::Context> context = v8::Local<v8::Context>::New(isolate, isolate->GetCurrentContext());
         v8::Context::Scope context_scope(context);
-        v8::Local<v8::Object> global = context->Global();
 
         v8::Local<v8::Promise::Resolver> resolver = v8::Promise::Resolver::New(context).ToLocalChecked();
         args.GetReturnValue().Set(resolver->GetPromise());
 
         v8::TryCatch try_catch(isolate);
 
-        v8::Local<v8::String> name;
-        v8::Local<v8::String> source;
+        std::string resourceName;
         {
-            v8::Local<v8::Value> arg = args[0];
-            v8::String::Utf8Value resource(isolate, arg);
-            std::string resourceName(*resource);
-            std::string resourceSource;
-            DEBUG("include: %s\n", resourceName.c_str());
-
-            V8Thread *thread = getByIsolate(isolate);
-            thread->resourceManager->asString(resourceName, resourceSource);
-            name = v8::String::NewFromUtf8(isolate, resourceName.c_str()).ToLocalChecked();
-            source = v8::String::NewFromUtf8(isolate, resourceSource.c_str(), v8::NewStringType::kNormal, static_cast<int>(resourceSource.length())).ToLocalChecked();
-        }
-
-        v8::ScriptOrigin origin(name,                         // source name
-                                v8::Integer::New(isolate, 0), // line offset
-                                v8::Integer::New(isolate, 0), // column offset
-                                v8::False(isolate),           // cross origin
-                                v8::Local<v8::Integer>(),     // script id
-                                v8::Local<v8::Value>(),       // source map url
-                                v8::False(isolate),           // is opaque
-                                v8::False(isolate),           // is WASM
-                                v8::True(isolate)             // is ES6 module
-        );
+            v8::String::Utf8Value resource(isolate, args[0]);
+            resourceName = *resource;
+        }
 
-        v8::ScriptCompiler::Source basescript(source, origin);
-        v8::MaybeLocal<v8::Module> maybeModule = v8::ScriptCompiler::CompileModule(isolate, &basescript);
+        v8::MaybeLocal<v8::Module> maybeModule = getModule(context, resourceName);
 
         if (!try_catch.HasCaught()) {
             v8::Local<v8::Module> module;
             if (maybeModule.ToLocal(&module)) {
-                v8::Maybe<bool> isModule = module->InstantiateModule(context, callResolve);
-                if (isModule.FromMaybe(false)) {
+                // cached modules may already be instantiated and evaluated
+                bool instantiated = module->GetStatus() != v8::Module::kUninstantiated || module->InstantiateModule(context, callResolve).FromMaybe(false);
+                if (instantiated) {
                     v8::Local<v8::Value> result;
-                    if (module->Evaluate(context).ToLocal(&result)) {
+                    if (isEvaluated(module) || module->Evaluate(context).ToLocal(&result)) {
                         result = module->GetModuleNamespace();
                         args.GetReturnValue().Set(result);
                         return;
@@ -304,6 +1260,85 @@ class V8Thread {
         }
     }
 
+    // get the compiled module of a resource; from the isolate cache while neither the resource nor its imports changed
+    static v8::MaybeLocal<v8::Module> getModule(v8::Local<v8::Context> context, const std::string &name) {
+        auto isolate = context->GetIsolate();
+        // there is no cache while the startup snapshot is created
+        V8Thread *thread = getByIsolate(isolate);
+        if (thread != nullptr && thread->isModuleFresh(name, 0)) {
+            v8::Local<v8::Module> module = thread->moduleCache[name].module.Get(isolate);
+            if (module->GetStatus() != v8::Module::kErrored) {
+                return module;
+            }
+        }
+
+        util::ResourceManager *resources = getResourceManager(isolate);
+        const long long modified = resources->getModified(name);
+        std::string src;
+        resources->asString(name, src);
+        v8::MaybeLocal<v8::Module> maybeModule = loadModule(context, name.c_str(), src, modified);
+
+        v8::Local<v8::Module> module;
+        if (thread != nullptr && maybeModule.ToLocal(&module)) {
+            CachedModule &cached = thread->moduleCache[name];
+            if (!cached.module.IsEmpty()) {
+                thread->forgetModuleName(isolate, cached.module.Get(isolate));
+            }
+            cached.module.Reset(isolate, module);
+            cached.modified = modified;
+            cached.checked = std::chrono::steady_clock::now();
+            cached.imports.clear();
+            thread->moduleNames.emplace(module->GetIdentityHash(), name);
+        }
+        return maybeModule;
+    }
+
+    // entry of the cached module in moduleNames; end() if it is not cached
+    std::multimap<int, std::string>::iterator findModuleName(v8::Isolate *isolate, v8::Local<v8::Module> module) {
+        auto range = moduleNames.equal_range(module->GetIdentityHash());
+        for (auto it = range.first; it != range.second; ++it) {
+            auto cached = moduleCache.find(it->second);
+            if (cached != moduleCache.end() && cached->second.module.Get(isolate) == module) {
+                return it;
+            }
+        }
+        return moduleNames.end();
+    }
+
+    void forgetModuleName(v8::Isolate *isolate, v8::Local<v8::Module> module) {
+        auto found = findModuleName(isolate, module);
+        if (found != moduleNames.end()) {
+            moduleNames.erase(found);
+        }
+    }
+
+    static bool isEvaluated(v8::Local<v8::Module> module) { return module->GetStatus() == v8::Module::kEvaluating || module->GetStatus() == v8::Module::kEvaluated; }
+
+    // a cached module is fresh if its resource was not modified and all its imports are fresh
+    // modification times are checked at most once per MODULE_CHECK_INTERVAL
+    bool isModuleFresh(const std::string &name, int depth) {
+        auto found = moduleCache.find(name);
+        if (found == moduleCache.end()) {
+            return false;
+        }
+        CachedModule &cached = found->second;
+        auto now = std::chrono::steady_clock::now();
+        if (now - cached.checked >= std::chrono::milliseconds(MODULE_CHECK_INTERVAL)) {
+            if (resourceManager->getModified(name) != cached.modified) {
+                return false;
+            }
+            cached.checked = now;
+        }
+        if (depth < MODULE_DEPTH_LIMIT) {
+            for (const std::string &import : cached.imports) {
+                if (import != name && !isModuleFresh(import, depth + 1)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
     static std::string getExceptionString(v8::Isolate *isolate, v8::String::Utf8Value &exception, v8::Local<v8::Message> &message) {
         std::string exceptionString;
         const char *exception_string = *exception;
@@ -384,12 +1419,14 @@ class V8Thread {
         }
     }
 
-    static v8::MaybeLocal<v8::Module> loadModule(v8::Local<v8::Context> context, const char *name, const char *code) {
+    // compile a module; the code cache stored for this resource version is consumed when present
+    // and a new one is stored when there was none or V8 rejected it as stale
+    static v8::MaybeLocal<v8::Module> loadModule(v8::Local<v8::Context> context, const char *name, const std::string &code, long long modified) {
         // Convert char[] to VM's string type
         auto isolate = context->GetIsolate();
         DEBUG("import: %s\n", name);
 
-        v8::Local<v8::String> vcode = v8::String::NewFromUtf8(isolate, code).ToLocalChecked();
+        v8::Local<v8::String> vcode = v8::String::NewFromUtf8(isolate, code.c_str(), v8::NewStringType::kNormal, static_cast<int>(code.length())).ToLocalChecked();
         // Create script origin to determine if it is module or not.
         // Only first and last argument matters; other ones are default values.
         // First argument gives script name (useful in error messages), last
@@ -405,10 +1442,33 @@ class V8Thread {
                                 v8::True(isolate)                                        // is ES6 module
         );
 
+        util::ResourceManager *resources = getResourceManager(isolate);
+        std::string cache;
+        v8::ScriptCompiler::CachedData *cachedData = nullptr;
+        if (modified >= 0 && resources->readCodeCache(name, modified, code.length(), cache)) {
+            // the source takes ownership of cachedData, the bytes stay in cache
+            cachedData = new v8::ScriptCompiler::CachedData((const uint8_t *)cache.data(), cache.length());
+        }
+
         // Compiling module from source (code + origin)
-        v8::ScriptCompiler::Source source(vcode, origin);
+        v8::ScriptCompiler::Source source(vcode, origin, cachedData);
         v8::MaybeLocal<v8::Module> mod;
-        mod = v8::ScriptCompiler::CompileModule(isolate, &source);
+        mod = v8::ScriptCompiler::CompileModule(isolate, &source, cachedData != nullptr ? v8::ScriptCompiler::kConsumeCodeCache : v8::ScriptCompiler::kNoCompileOptions);
+
+        v8::Local<v8::Module> module;
+        if (modified >= 0 && mod.ToLocal(&module)) {
+            if (cachedData != nullptr && source.GetCachedData()->rejected) {
+                DEBUG("code cache rejected: %s\n", name);
+                cachedData = nullptr;
+            }
+            if (cachedData == nullptr) {
+                v8::ScriptCompiler::CachedData *created = v8::ScriptCompiler::CreateCodeCache(module->GetUnboundModuleScript());
+                if (created != nullptr) {
+                    resources->writeCodeCache(name, modified, code.length(), created->data, created->length);
+                    delete created;
+                }
+            }
+        }
         // Returning non-checked module
         return mod;
     }
@@ -420,6 +1480,10 @@ class V8Thread {
             fprintf(stderr, "Error loading module!\n");
             return false;
         }
+        if (mod->GetStatus() != v8::Module::kUninstantiated) {
+            // cached and already instantiated
+            return mod->GetStatus() != v8::Module::kErrored;
+        }
         v8::Maybe<bool> result = mod->InstantiateModule(context, callResolve);
         // return !result.IsNothing();
         return result.FromMaybe(false);
@@ -428,7 +1492,10 @@ class V8Thread {
     static v8::Local<v8::Value> runModule(v8::Local<v8::Context> context, v8::Local<v8::Module> module, bool nsObject) {
         auto isolate = context->GetIsolate();
         v8::Local<v8::Value> retValue;
-        if (module->Evaluate(context).ToLocal(&retValue)) {
+        if (isEvaluated(module)) {
+            // cached and already evaluated
+            retValue = module->GetModuleNamespace();
+        } else if (module->Evaluate(context).ToLocal(&retValue)) {
             if (nsObject) {
                 retValue = module->GetModuleNamespace();
             }
@@ -442,12 +1509,16 @@ class V8Thread {
     static v8::MaybeLocal<v8::Module> callResolve(v8::Local<v8::Context> context, v8::Local<v8::String> specifier, v8::Local<v8::Module> referrer) {
         auto isolate = context->GetIsolate();
         v8::String::Utf8Value name(isolate, specifier);
-        V8Thread *thread = getByIsolate(isolate);
         std::string resource(*name);
-        std::string src;
-        thread->resourceManager->asString(resource, src);
-        auto module = loadModule(context, *name, src.c_str());
-        return module;
+        V8Thread *thread = getByIsolate(isolate);
+        if (thread != nullptr) {
+            // remember the import so the referrer is recompiled when the imported resource changes
+            auto referrerName = thread->findModuleName(isolate, referrer);
+            if (referrerName != thread->moduleNames.end()) {
+                thread->moduleCache[referrerName->second].imports.push_back(resource);
+            }
+        }
+        return getModule(context, resource);
     }
 
     static v8::MaybeLocal<v8::Promise> callDynamic(v8::Local<v8::Context> context, v8::Local<v8::ScriptOrModule> referrer, v8::Local<v8::String> specifier) {
@@ -458,11 +1529,8 @@ class V8Thread {
         v8::Local<v8::Promise::Resolver> resolver = v8::Promise::Resolver::New(context).ToLocalChecked();
         v8::MaybeLocal<v8::Promise> promise(resolver->GetPromise());
         v8::String::Utf8Value name(isolate, specifier);
-        V8Thread *thread = getByIsolate(isolate);
         std::string resource(*name);
-        std::string src;
-        thread->resourceManager->asString(resource, src);
-        v8::MaybeLocal<v8::Module> molule = loadModule(context, *name, src.c_str());
+        v8::MaybeLocal<v8::Module> molule = getModule(context, resource);
         if (checkModule(context, molule)) {
             v8::Local<v8::Module> localModule;
             if (molule.ToLocal(&localModule)) {
@@ -500,27 +1568,17 @@ class V8Thread {
         v8::Local<v8::Message> message;
         // Assume that all objects are stack-traces.
 
-        const int socket = getSocket(isolate);
+        // the response is served by the catch in __global__.js; here unhandled rejections are only logged
         if (exception->IsObject()) {
             v8::String::Utf8Value exceptionStr(isolate, exception);
             message = v8::Exception::CreateMessage(isolate, exception);
             std::string error = getExceptionString(isolate, exceptionStr, message);
             fputs(error.c_str(), stderr);
-            // response as error
-            if (socket > 0) {
-                serveError(socket, error);
-            }
         } else {
             v8::String::Utf8Value exceptionStr(isolate, exception);
             fputs(*exceptionStr, stderr);
-            // response as error
-            if (socket > 0) {
-                serveError(socket, *exceptionStr);
-            }
         }
     }
 };
 
-std::map<void *, util::V8Thread *> util::V8Thread::isolateToThread = {};
-
 } // namespace util
\ No newline at end of file
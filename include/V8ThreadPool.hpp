@@ -0,0 +1,98 @@
+#pragma once
+
+#include "V8Thread.hpp"
+
+namespace util {
+
+// owns the V8 platform, the startup snapshot and a fixed number of isolates, each on its own V8Thread
+// with its own context and __global__.js handler; tasks go to the least loaded isolate
+class V8ThreadPool {
+  private:
+    std::unique_ptr<util::V8Platform> platform;
+    v8::StartupData snapshot;
+    int threadsCount;
+    V8Thread **threads;
+    std::atomic<unsigned int> next;
+
+  public:
+    // database is the libpq connection string every isolate connects with, up to databasePool connections each
+    V8ThreadPool(const char *_argv0, util::ResourceManager *_resourceManager, util::HTTPMultiThreadServer *_httpServer, int _threadsCount, const char *_database, int _databasePool) : next(0) {
+        threadsCount = _threadsCount > 0 ? _threadsCount : 1;
+        // Creating platform; the default one wrapped so posted tasks wake up the isolate threads
+        platform = std::make_unique<util::V8Platform>(v8::platform::NewDefaultPlatform(2, v8::platform::IdleTaskSupport::kEnabled));
+        // Initializing V8 VM once for all isolates
+        v8::V8::InitializePlatform(platform.get());
+        v8::V8::Initialize();
+
+        // __global__.js is evaluated once and every isolate starts from that state; the state is saved
+        // and reused by the next boots until V8, the binary or one of the resources read for it changes
+        const std::string key = getSnapshotKey();
+        std::string saved;
+        if (_resourceManager->readSnapshot(key, saved)) {
+            char *data = new char[saved.length()];
+            memcpy(data, saved.data(), saved.length());
+            snapshot.data = data;
+            snapshot.raw_size = (int)saved.length();
+        } else {
+            std::string resources;
+            _resourceManager->recordReads(&resources);
+            snapshot = V8Thread::createSnapshot(_resourceManager);
+            _resourceManager->recordReads(nullptr);
+            if (snapshot.data != nullptr) {
+                _resourceManager->writeSnapshot(key, resources, snapshot.data, snapshot.raw_size);
+            }
+        }
+        if (snapshot.data == nullptr) {
+            fputs("startup snapshot not created; isolates bootstrap on their own\n", stderr);
+        }
+
+        threads = new V8Thread *[threadsCount];
+        for (int i = 0; i < threadsCount; i++) {
+            threads[i] = new V8Thread(_argv0, _resourceManager, _httpServer, platform.get(), snapshot.data != nullptr ? &snapshot : nullptr, _database, _databasePool);
+        }
+    }
+
+    ~V8ThreadPool() {
+        for (int i = 0; i < threadsCount; i++) {
+            delete threads[i];
+        }
+        delete[] threads;
+        delete[] snapshot.data;
+    }
+
+    int getThreadsCount() { return threadsCount; }
+
+    // a snapshot only fits the V8 version and the binary (its external references) it was made with
+    static std::string getSnapshotKey() {
+        std::string key("uron snapshot ");
+        key += v8::V8::GetVersion();
+        struct stat stat_buf;
+        if (stat("/proc/self/exe", &stat_buf) == 0) {
+            key += " " + std::to_string((long long)stat_buf.st_mtim.tv_sec * 1000000000LL + stat_buf.st_mtim.tv_nsec) + " " + std::to_string((long)stat_buf.st_size);
+        }
+        return key;
+    }
+
+    // dispatch to the isolate with the fewest queued and running requests
+    // the scan starts at a rotating index so equally loaded isolates share the work
+    void enqueueTask(V8Task *task) {
+        const unsigned int start = next.fetch_add(1, std::memory_order_relaxed);
+        V8Thread *selected = threads[start % threadsCount];
+        int selectedLoad = selected->getLoad();
+        for (int i = 1; i < threadsCount && selectedLoad > 0; i++) {
+            V8Thread *thread = threads[(start + i) % threadsCount];
+            const int threadLoad = thread->getLoad();
+            if (threadLoad < selectedLoad) {
+                selected = thread;
+                selectedLoad = threadLoad;
+            }
+        }
+        selected->enqueueTask(task);
+    }
+
+    // no assignments allowed
+    V8ThreadPool &operator=(const V8ThreadPool &) = delete;
+    V8ThreadPool &operator=(V8ThreadPool &&) = delete;
+};
+
+} // namespace util
@@ -1,7 +1,7 @@
 
 #include "HTTPMultiThreadServer.hpp"
 #include "ResourceManager.hpp"
-#include "V8Thread.hpp"
+#include "V8ThreadPool.hpp"
 #include <signal.h>
 #include <stdlib.h>
 #include <thread>
@@ -10,70 +10,104 @@
 typedef struct {
     util::ResourceManager *resourceManager;
     util::HTTPMultiThreadServer *httpServer;
-    util::V8Thread *v8Thread;
+    util::V8ThreadPool *v8ThreadPool;
 } Context;
 
-void response404(const int socket, const std::string &uri) {
+void response404(Context *context, const int socket, std::string_view uri) {
     char content[500];
-    sprintf(content, "resource not found: %s", uri.c_str());
+    snprintf(content, sizeof(content), "resource not found: %.*s", (int)uri.length(), uri.data());
     char header[1024];
     sprintf(header, "HTTP/1.1 404 Resource Not Found\r\nContent-type: text/plain\r\nContent-Length: %ld\r\n\r\n%s", strlen(content), content);
     write(socket, header, strlen(header));
-    close(socket);
+    context->httpServer->releaseConnection(socket);
 }
 
 void connection_handler(util::HTTPRequest *request, void *_context) {
     Context *context = (Context *)_context;
     const auto socket = request->socket;
     // content type
-    const char *contentType = context->resourceManager->getContentType(request->uri);
+    const char *contentType = context->resourceManager->getContentType(request->path);
 
     if (strcmp(contentType, EXECUTE) == 0) {
-        // execute on server
-        const char *ex = strrchr(request->uri, '.');
-        if (ex != nullptr) {
-            std::string fileJS;
-            fileJS.append(request->uri, ex - request->uri);
+        // execute on server: the module of path/name.ext is path/name.js; it goes with the task, so the one checked here is the one run
+        const size_t ex = request->path.find_last_of('.');
+        if (ex != std::string_view::npos) {
+            std::string fileJS(request->path.substr(0, ex));
             fileJS += ".js";
             const long size = context->resourceManager->getSize(fileJS.c_str());
             if (size <= 0) {
-                response404(request->socket, request->uri);
+                response404(context, request->socket, request->uri);
                 return;
             }
-            auto task = new util::V8Task(socket, fileJS, request->method, request->uri);
-            context->v8Thread->enqueueTask(task);
+            auto task = new util::V8Task(fileJS, request);
+            context->v8ThreadPool->enqueueTask(task);
         }
     } else {
-        const long size = context->resourceManager->getSize(request->uri);
-        if (size <= 0) {
-            response404(request->socket, request->uri);
+        const std::string uri(request->path);
+        std::shared_ptr<util::ResourceResponse> response = context->resourceManager->getResponse(uri, contentType);
+        if (!response || response->file->size <= 0) {
+            response404(context, request->socket, request->uri);
             return;
         }
 
-        { // serve file
-            char header[1024];
-            sprintf(header, "HTTP/1.1 200 OK\r\nContent-type: %s\r\nContent-Length: %ld\r\n\r\n", contentType, size);
-            write(socket, header, strlen(header));
-            context->resourceManager->writeToSocket(request->uri, socket);
-            close(socket);
+        // serve file
+        if (context->resourceManager->sendResponse(*response, socket, request->getHeader("accept-encoding"), request->getHeader("if-none-match"), request->getHeader("if-modified-since"))) {
+            context->httpServer->releaseConnection(socket);
+        } else {
+            context->httpServer->releaseConnection(socket, true);
         }
     }
 }
 
+// get value of a KEY=value command line argument; defaultValue if missing
+const char *getArgument(int argc, char *argv[], const char *key, const char *defaultValue) {
+    const size_t keyLength = strlen(key);
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], key, keyLength) == 0 && argv[i][keyLength] == '=') {
+            return argv[i] + keyLength + 1;
+        }
+    }
+    return defaultValue;
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGPIPE, SIG_IGN);
-    const int port = 8888;
+    // listening port; PORT=n
+    const int port = atoi(getArgument(argc, argv, "PORT", "8888"));
+    if (port <= 0 || port > 65535) {
+        fprintf(stderr, "invalid PORT: %s\n", getArgument(argc, argv, "PORT", ""));
+        return 1;
+    }
+    // threads accepting and reading connections, each with its own epoll; EVENT_THREADS=n
+    int eventThreads = atoi(getArgument(argc, argv, "EVENT_THREADS", "1"));
+    if (eventThreads <= 0) {
+        eventThreads = 1;
+    }
     Context context;
 
     util::ResourceManager resourceManager("./cache");
-    util::HTTPMultiThreadServer server(port, 2, 1000);
+    util::HTTPMultiThreadServer server(port, 2, 1000, eventThreads);
 
     if (server.isInitialized()) {
-        util::V8Thread v8executionThread(argv[0], &resourceManager);
+        // largest request body in bytes; BODY_LIMIT=n
+        const long bodyLimit = atol(getArgument(argc, argv, "BODY_LIMIT", "0"));
+        if (bodyLimit > 0) {
+            server.setBodyLimit(bodyLimit);
+        }
+        // one isolate per core unless ISOLATES=n is given
+        int isolates = atoi(getArgument(argc, argv, "ISOLATES", "0"));
+        if (isolates <= 0) {
+            isolates = std::thread::hardware_concurrency();
+        }
+        // postgres connection string of the isolates; DB=conninfo, libpq defaults when empty
+        const char *database = getArgument(argc, argv, "DB", "");
+        // postgres connections per isolate; DB_POOL=n
+        const int databasePool = atoi(getArgument(argc, argv, "DB_POOL", "0"));
+        util::V8ThreadPool v8ThreadPool(argv[0], &resourceManager, &server, isolates, database, databasePool);
 
         context.resourceManager = &resourceManager;
         context.httpServer = &server;
-        context.v8Thread = &v8executionThread;
+        context.v8ThreadPool = &v8ThreadPool;
 
         if (server.startListening(connection_handler, (void *)&context)) {
             fprintf(stderr, "%s", server.getError());
@@ -0,0 +1,62 @@
+// framing of requests by the parser: what is accepted, and what is refused with which status
+// usage: HTTPParserTest
+
+#include "HTTPParser.hpp"
+
+#include <stdio.h>
+#include <string>
+
+#define CHECK(condition)                                                          \
+    if (!(condition)) {                                                           \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++;                                                               \
+    }
+
+static int failures = 0;
+
+// status of the parsed request: 200 when it is accepted, else the status of the error
+static int parse(const std::string &request) {
+    util::HTTPParser parser;
+    util::HTTPParser::Result result = parser.parse(request.data(), request.length());
+    return result == util::HTTPParser::COMPLETE ? 200 : result == util::HTTPParser::INCOMPLETE ? 0 : parser.getStatus();
+}
+
+int main() {
+    CHECK(parse("GET / HTTP/1.1\r\nHost: x\r\n\r\n") == 200);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc") == 200);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc") == 200);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == 200);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: , Chunked ,\r\n\r\n") == 200);
+
+    // two framings or two lengths
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nTransfer-Encoding: chunked\r\n\r\n") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nContent-Length: 3\r\n\r\n") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\nabcd") == 400);
+
+    // lengths that are not DIGIT+
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: +3\r\n\r\nabc") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 3 3\r\n\r\n") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999\r\n\r\n") == 400);
+
+    // codings that are not decoded
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: notchunked\r\n\r\n") == 501);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip, chunked\r\n\r\n") == 501);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked, chunked\r\n\r\n") == 501);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n") == 501);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\nTransfer-Encoding: chunked\r\n\r\n") == 501);
+    CHECK(parse("POST / HTTP/1.1\r\nTransfer-Encoding: identity\r\n\r\n") == 501);
+
+    // header names that are no tokens
+    CHECK(parse("POST / HTTP/1.1\r\nContent-Length : 5\r\n\r\nabcde") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\n Content-Length: 5\r\n\r\nabcde") == 400);
+    CHECK(parse("POST / HTTP/1.1\r\nContent\tLength: 5\r\n\r\nabcde") == 400);
+    CHECK(parse("GET / HTTP/1.1\r\nX(y): 1\r\n\r\n") == 400);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("HTTPParserTest passed");
+    return 0;
+}
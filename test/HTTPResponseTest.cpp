@@ -0,0 +1,152 @@
+// responses written to a socket pair whose other end does not read: nothing may block, the rest stays pending
+// usage: HTTPResponseTest
+
+#include "HTTPResponse.hpp"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CHECK(condition)                                                          \
+    if (!(condition)) {                                                           \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++;                                                               \
+    }
+
+static int failures = 0;
+
+// read what is there and send what is pending in turns until the response is drained
+static std::string drain(util::HTTPResponse &response, int sockets[2]) {
+    std::string received;
+    char buffer[65536];
+    for (int i = 0; i < 100000 && !response.isDrained(); i++) {
+        ssize_t bytes = recv(sockets[1], buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (bytes > 0) {
+            received.append(buffer, bytes);
+        }
+        response.sendPending(sockets[0]);
+    }
+    ssize_t bytes;
+    while ((bytes = recv(sockets[1], buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        received.append(buffer, bytes);
+    }
+    return received;
+}
+
+static bool openPair(int sockets[2]) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        return false;
+    }
+    // a small send buffer, so the responses below do not fit; the sockets stay blocking like the connections
+    int size = 4096;
+    setsockopt(sockets[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    return true;
+}
+
+int main() {
+    // like the server: a peer that went away fails the write instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    const std::string body(4 * 1024 * 1024, 'x');
+    int sockets[2];
+
+    // collected response: the last flush returns although the peer reads nothing
+    if (!openPair(sockets)) {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        util::HTTPResponse response;
+        response.setStatus(200, "OK");
+        response.addHeader("content-type", "text/plain");
+        response.append(body.data(), body.length());
+        CHECK(response.flush(sockets[0], true));
+        CHECK(!response.isDrained());
+        CHECK(!response.isWritable());
+        std::string received = drain(response, sockets);
+        CHECK(response.isDrained() && !response.isFailed());
+        CHECK(received.find("content-length: 4194304\r\n") != std::string::npos);
+        CHECK(received.length() > body.length() && received.compare(received.length() - body.length(), body.length(), body) == 0);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+
+    // big writes go out from the caller memory; what is not taken is copied before the call returns
+    if (!openPair(sockets)) {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        util::HTTPResponse response;
+        response.setStatus(200, "OK");
+        response.addHeader("content-length", std::to_string(2 * body.length()));
+        std::string first(body);
+        CHECK(response.write(sockets[0], first.data(), first.length()));
+        first.assign(first.length(), 'y');
+        CHECK(response.write(sockets[0], body.data(), body.length()));
+        CHECK(response.flush(sockets[0], true));
+        std::string received = drain(response, sockets);
+        CHECK(received.length() > 2 * body.length() && received.compare(received.length() - 2 * body.length(), 2 * body.length(), body + body) == 0);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+
+    // streamed response: the end chunk waits in pending as well
+    if (!openPair(sockets)) {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        util::HTTPResponse response;
+        response.setStatus(200, "OK");
+        CHECK(response.stream(sockets[0]));
+        response.append(body.data(), body.length());
+        CHECK(response.flush(sockets[0], true));
+        CHECK(!response.isDrained());
+        std::string received = drain(response, sockets);
+        CHECK(response.isDrained() && !response.isFailed());
+        CHECK(received.find("transfer-encoding: chunked\r\n") != std::string::npos);
+        CHECK(received.length() > 5 && received.compare(received.length() - 5, 5, "0\r\n\r\n") == 0);
+    }
+    close(sockets[0]);
+    close(sockets[1]);
+
+    // nothing from the handler may end the head early
+    {
+        util::HTTPResponse response;
+        CHECK(!response.setStatus(200, "OK\r\nset-cookie: a=b"));
+        CHECK(response.setStatus(200, "OK"));
+        CHECK(response.addHeader("x-fine", "a value\twith tab"));
+        CHECK(!response.addHeader("x-split", "a\r\nset-cookie: a=b"));
+        CHECK(!response.addHeader("x-split", "a\nb"));
+        CHECK(!response.addHeader("x-nul", std::string("a\0b", 3)));
+        CHECK(!response.addHeader("x split", "a"));
+        CHECK(!response.addHeader("x-split\r\nset-cookie", "a"));
+        CHECK(!response.addHeader("", "a"));
+    }
+
+    // a peer that went away fails the response instead of leaving it pending
+    if (!openPair(sockets)) {
+        perror("socketpair");
+        return 1;
+    }
+    {
+        util::HTTPResponse response;
+        response.setStatus(200, "OK");
+        response.append(body.data(), body.length());
+        response.flush(sockets[0], true);
+        close(sockets[1]);
+        response.sendPending(sockets[0]);
+        CHECK(response.isFailed() && response.isDrained());
+    }
+    close(sockets[0]);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("HTTPResponseTest passed");
+    return 0;
+}
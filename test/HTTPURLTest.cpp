@@ -0,0 +1,49 @@
+// request targets accepted and refused by the URL decoder; targets come without their leading slashes
+// usage: HTTPURLTest
+
+#include "HTTPURL.hpp"
+
+#include <stdio.h>
+#include <string>
+
+#define CHECK(condition)                                                          \
+    if (!(condition)) {                                                           \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++;                                                               \
+    }
+
+static int failures = 0;
+
+static bool accepted(const char *uri) {
+    util::HTTPURL url;
+    return url.parse(uri);
+}
+
+int main() {
+    util::HTTPURL url;
+    CHECK(url.parse("dir/file.js?a=1&b=x%20y"));
+    CHECK(url.getPath() == "dir/file.js");
+    CHECK(url.size() == 2 && url.name(1) == "b" && url.value(1) == "x y");
+    CHECK(accepted("index.html"));
+    CHECK(accepted("dir/name.with.dots"));
+
+    // the code caches must not be served
+    CHECK(!accepted(".codecache/x"));
+    CHECK(!accepted(".codecache/snapshot.blob"));
+    CHECK(!accepted("%2ecodecache/x"));
+    CHECK(!accepted("dir/.hidden"));
+    CHECK(!accepted("."));
+    CHECK(!accepted(".."));
+    CHECK(!accepted("dir/../__global__.js"));
+    CHECK(!accepted("dir//file"));
+    CHECK(!accepted("dir%2ffile"));
+    url.parse(".codecache/x");
+    CHECK(url.getError() != nullptr && std::string(url.getError()) == "dot segment in path");
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("HTTPURLTest passed");
+    return 0;
+}
@@ -0,0 +1,116 @@
+// static responses of the resource manager written to a socket pair and read back
+// usage: ResourceManagerTest
+
+#include "ResourceManager.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+#define CHECK(condition)                                                          \
+    if (!(condition)) {                                                           \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        failures++;                                                               \
+    }
+
+static int failures = 0;
+
+static void writeResource(const std::string &folder, const char *name, const std::string &content) {
+    std::string filename = folder + "/" + name;
+    FILE *file = fopen(filename.c_str(), "wb");
+    fwrite(content.data(), 1, content.length(), file);
+    fclose(file);
+}
+
+// send the response of a resource and read everything that was written
+static std::string serve(util::ResourceManager &resources, const char *name, const char *acceptEncoding) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        return "";
+    }
+    std::string received;
+    std::thread reader([&] {
+        char buffer[65536];
+        ssize_t bytes;
+        while ((bytes = read(sockets[1], buffer, sizeof(buffer))) > 0) {
+            received.append(buffer, bytes);
+        }
+    });
+    std::shared_ptr<util::ResourceResponse> response = resources.getResponse(name, resources.getContentType(name));
+    if (response) {
+        resources.sendResponse(*response, sockets[0], acceptEncoding, "", "");
+    }
+    close(sockets[0]);
+    reader.join();
+    close(sockets[1]);
+    return received;
+}
+
+static long contentLength(const std::string &response) {
+    size_t found = response.find("Content-Length: ");
+    return found == std::string::npos ? -2 : atol(response.c_str() + found + 16);
+}
+
+static size_t bodyLength(const std::string &response) {
+    size_t found = response.find("\r\n\r\n");
+    return found == std::string::npos ? 0 : response.length() - found - 4;
+}
+
+int main() {
+    char folder[] = "/tmp/uron-resources-XXXXXX";
+    if (mkdtemp(folder) == nullptr) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // bigger than RESPONSE_BODY_LIMIT, so the body stays on disk and goes out with sendfile
+    std::string big(RESPONSE_BODY_LIMIT + 12345, 'x');
+    writeResource(folder, "big.txt", big);
+    writeResource(folder, "small.txt", "hello");
+    writeResource(folder, "empty.txt", "");
+    util::ResourceManager resources(folder);
+
+    std::string response = serve(resources, "big.txt", "");
+    CHECK(contentLength(response) == (long)big.length());
+    CHECK(bodyLength(response) == big.length());
+
+    response = serve(resources, "small.txt", "");
+    CHECK(contentLength(response) == 5);
+    CHECK(bodyLength(response) == 5);
+
+    response = serve(resources, "empty.txt", "");
+    CHECK(contentLength(response) == 0);
+    CHECK(bodyLength(response) == 0);
+
+    // compressed variants are made in the background; the first response goes out uncompressed
+    std::string text;
+    for (int i = 0; i < 1000; i++) {
+        text += "compressible line " + std::to_string(i % 10) + "\n";
+    }
+    writeResource(folder, "text.txt", text);
+    response = serve(resources, "text.txt", "gzip, br");
+    CHECK(response.find("Content-Encoding") == std::string::npos);
+    CHECK(bodyLength(response) == text.length());
+    for (int i = 0; i < 500 && response.find("Content-Encoding: br") == std::string::npos; i++) {
+        usleep(10000);
+        response = serve(resources, "text.txt", "gzip, br");
+    }
+    CHECK(response.find("Content-Encoding: br") != std::string::npos);
+    CHECK(contentLength(response) == (long)bodyLength(response) && bodyLength(response) < text.length());
+    response = serve(resources, "text.txt", "gzip");
+    CHECK(response.find("Content-Encoding: gzip") != std::string::npos);
+    CHECK(contentLength(response) == (long)bodyLength(response));
+
+    std::string command = std::string("rm -rf ") + folder;
+    if (system(command.c_str()) != 0) {
+        fprintf(stderr, "could not remove %s\n", folder);
+    }
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    puts("ResourceManagerTest passed");
+    return 0;
+}